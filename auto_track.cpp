@@ -342,7 +342,7 @@ std::string run_auto_track(
                         progress::at(thread.get_total_tract_count(),
                                    thread.param.termination_count);
                         thread.fetchTracks(&tract_model);
-                        std::this_thread::sleep_for(std::chrono::seconds(2));
+                        thread.wait_for_tracts(thread.param.termination_count/10+1,std::chrono::seconds(2));
                         // terminate if yield rate is very low, likely quality problem
                         if(thread.get_total_seed_count() > low_yield_threshold &&
                            thread.get_total_tract_count() < thread.get_total_seed_count()/low_yield_threshold)
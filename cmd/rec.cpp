@@ -92,7 +92,44 @@ int rec(program_option& po)
     if(po.has("motion_correction"))
     {
         std::cout << "correct for motion..." << std::endl;
-        src.correct_motion(po.get("motion_correction",0));
+        src.voxel.thread_count = po.get("thread_count",uint32_t(std::thread::hardware_concurrency()));
+        // --motion_correction_parallel=1 registers the volumes independently from the first estimate
+        bool parallel = po.get("motion_correction_parallel",0);
+        if(po.get("motion_check",0))
+        {
+            // run the serial path first, restore the input, then run the parallel path
+            // and report how far apart the two corrected volumes end up
+            std::vector<tipl::image<3,unsigned short> > input(src.src_dwi_data.size()),serial(src.src_dwi_data.size());
+            auto input_bvectors = src.src_bvectors;
+            for(size_t i = 0;i < input.size();++i)
+                input[i] = src.dwi_at(i);
+            src.correct_motion(po.get("motion_correction",0),false);
+            for(size_t i = 0;i < serial.size();++i)
+            {
+                serial[i] = src.dwi_at(i);
+                std::copy(input[i].begin(),input[i].end(),src.dwi_write_at(i).begin());
+            }
+            auto serial_bvectors = src.src_bvectors;
+            src.src_bvectors = input_bvectors;
+            src.correct_motion(po.get("motion_correction",0),true);
+            for(size_t i = 0;i < serial.size();++i)
+            {
+                auto I = src.dwi_at(i);
+                double sum2 = 0.0,max_dif = 0.0;
+                for(size_t j = 0;j < I.size();++j)
+                {
+                    double dif = std::fabs(double(I[j])-double(serial[i][j]));
+                    sum2 += dif*dif;
+                    max_dif = std::max(max_dif,dif);
+                }
+                std::cout << "dwi (" << i+1 << "/" << serial.size() << ") serial vs parallel rms:"
+                          << std::sqrt(sum2/double(I.size())) << " max:" << max_dif
+                          << " bvec angle:" << std::acos(std::min(1.0f,std::fabs(serial_bvectors[i]*src.src_bvectors[i])))*180.0/3.14159265358979323846
+                          << std::endl;
+            }
+        }
+        else
+            src.correct_motion(po.get("motion_correction",0),parallel);
         std::cout << "done." <<std::endl;
     }
 
@@ -203,7 +240,10 @@ int rec(program_option& po)
         src.save_to_file(new_src_file.c_str());
         return 0;
     }
-    if (src.reconstruction())
+    bool result = src.reconstruction();
+    // the voxel-major DWI cache only pays off across repeated reconstructions
+    src.voxel.clear_dwi_cache();
+    if (result)
         std::cout << "reconstruction finished." << std::endl;
     else
     {
@@ -168,6 +168,11 @@ bool export_track_info(program_option& po,std::shared_ptr<fib_data> handle,
 
             bool output_color = QString(cmd.c_str()).contains("color");
             bool output_end = QString(cmd.c_str()).contains("end");
+            // e.g. --export=tdi4_seg, tdi4_trilinear, or tdi4_length rasterize the segments between points
+            bool output_trilinear = QString(cmd.c_str()).contains("trilinear");
+            bool output_length = QString(cmd.c_str()).contains("length");
+            bool output_segment = !output_color && !output_end &&
+                                  (QString(cmd.c_str()).contains("seg") || output_trilinear || output_length);
             file_name_stat += ".nii.gz";
             tipl::matrix<4,4> tr;
             tipl::shape<3> dim;
@@ -198,11 +203,16 @@ bool export_track_info(program_option& po,std::shared_ptr<fib_data> handle,
                 std::cout << " in RGB color";
             if(output_end)
                 std::cout << " end point only";
+            if(output_segment)
+                std::cout << " by segments" << (output_trilinear ? " with trilinear weighting":"")
+                                            << (output_length ? " weighted by length":"");
             std::cout << std::endl;
             std::cout << "TDI dimension: " << dim << std::endl;
             std::cout << "TDI voxel size: " << vs << std::endl;
             std::cout << std::endl;
-            if(!TractModel::export_tdi(file_name_stat.c_str(),tract,dim,vs,tr,output_color,output_end))
+            if(output_segment ?
+                    !TractModel::export_segment_tdi(file_name_stat.c_str(),tract,dim,vs,tr,output_trilinear,output_length) :
+                    !TractModel::export_tdi(file_name_stat.c_str(),tract,dim,vs,tr,output_color,output_end))
             {
                 std::cout << "ERROR: failed to save file. Please check write permission." << std::endl;
                 return false;
@@ -325,52 +335,74 @@ bool get_connectivity_matrix(program_option& po,
 
         float t = po.get("connectivity_threshold",0.001f);
         for(int j = 0;j < connectivity_type_list.size();++j)
-        for(int k = 0;k < connectivity_value_list.size();++k)
         {
             std::string connectivity_roi = roi_file_name;
-            std::string connectivity_value = connectivity_value_list[k].toStdString();
             bool use_end_only = connectivity_type_list[j].toLower() == QString("end");
             std::cout << "count tracks by " << (use_end_only ? "ending":"passing") << std::endl;
-            std::cout << "calculate matrix using " << connectivity_value << std::endl;
-            QDir pwd = QDir::current();
-            if(connectivity_value == "trk")
-                QDir::setCurrent(QFileInfo(output_name.c_str()).absolutePath());
-            if(!data.calculate(handle,*(tract_model.get()),connectivity_value,use_end_only,t))
+
+            // all matrix values other than "trk" are computed together in one pass over the tracts
+            std::vector<std::string> value_list;
+            for(int k = 0;k < connectivity_value_list.size();++k)
+                if(connectivity_value_list[k] != "trk")
+                    value_list.push_back(connectivity_value_list[k].toStdString());
+            std::vector<tipl::image<2> > matrix_values;
+            if(!value_list.empty())
             {
-                std::cout << "connectivity calculation error:" << data.error_msg << std::endl;
-                return false;
+                std::cout << "calculate matrix using";
+                for(const auto& each : value_list)
+                    std::cout << " " << each;
+                std::cout << std::endl;
+                if(!data.calculate(handle,*(tract_model.get()),value_list,use_end_only,t,matrix_values))
+                {
+                    std::cout << "connectivity calculation error:" << data.error_msg << std::endl;
+                    return false;
+                }
             }
             if(data.overlap_ratio > 0.5f)
             {
                 std::cout << "the ROIs have a large overlapping area (ratio: "
                           << data.overlap_ratio << "). The network measure calculated may not be reliable" << std::endl;
             }
-            if(connectivity_value == "trk")
+            for(int k = 0,value_index = 0;k < connectivity_value_list.size();++k)
             {
-                // restore previous working directory
-                QDir::setCurrent(pwd.path());
-                continue;
+                std::string connectivity_value = connectivity_value_list[k].toStdString();
+                if(connectivity_value == "trk")
+                {
+                    std::cout << "calculate matrix using " << connectivity_value << std::endl;
+                    QDir pwd = QDir::current();
+                    QDir::setCurrent(QFileInfo(output_name.c_str()).absolutePath());
+                    bool result = data.calculate(handle,*(tract_model.get()),connectivity_value,use_end_only,t);
+                    // restore previous working directory
+                    QDir::setCurrent(pwd.path());
+                    if(!result)
+                    {
+                        std::cout << "connectivity calculation error:" << data.error_msg << std::endl;
+                        return false;
+                    }
+                    continue;
+                }
+                data.matrix_value.swap(matrix_values[value_index++]);
+                std::string file_name_stat(output_name);
+                file_name_stat += ".";
+                file_name_stat += (std::filesystem::exists(connectivity_roi)) ? QFileInfo(connectivity_roi.c_str()).baseName().toStdString():connectivity_roi;
+                file_name_stat += ".";
+                file_name_stat += connectivity_value;
+                file_name_stat += use_end_only ? ".end":".pass";
+                std::string network_measures(file_name_stat),connectogram(file_name_stat);
+                file_name_stat += ".connectivity.mat";
+                std::cout << "export connectivity matrix to " << file_name_stat << std::endl;
+                data.save_to_file(file_name_stat.c_str());
+                connectogram += ".connectogram.txt";
+                std::cout << "export connectogram to " << connectogram << std::endl;
+                data.save_to_connectogram(connectogram.c_str());
+
+                network_measures += ".network_measures.txt";
+                std::cout << "export network measures to " << network_measures << std::endl;
+                std::string report;
+                data.network_property(report);
+                std::ofstream out(network_measures.c_str());
+                out << report;
             }
-            std::string file_name_stat(output_name);
-            file_name_stat += ".";
-            file_name_stat += (std::filesystem::exists(connectivity_roi)) ? QFileInfo(connectivity_roi.c_str()).baseName().toStdString():connectivity_roi;
-            file_name_stat += ".";
-            file_name_stat += connectivity_value;
-            file_name_stat += use_end_only ? ".end":".pass";
-            std::string network_measures(file_name_stat),connectogram(file_name_stat);
-            file_name_stat += ".connectivity.mat";
-            std::cout << "export connectivity matrix to " << file_name_stat << std::endl;
-            data.save_to_file(file_name_stat.c_str());
-            connectogram += ".connectogram.txt";
-            std::cout << "export connectogram to " << connectogram << std::endl;
-            data.save_to_connectogram(connectogram.c_str());
-
-            network_measures += ".network_measures.txt";
-            std::cout << "export network measures to " << network_measures << std::endl;
-            std::string report;
-            data.network_property(report);
-            std::ofstream out(network_measures.c_str());
-            out << report;
         }
     }
     return true;
@@ -670,6 +702,7 @@ int trk(program_option& po,std::shared_ptr<fib_data> handle)
     {
         tracking_thread.param.termination_count = po.get("fiber_count",uint32_t(tracking_thread.param.termination_count));
         tracking_thread.param.stop_by_tract = 1;
+        // with fiber_count, seed_count caps the seeds drawn by all threads together
         tracking_thread.param.max_seed_count = po.get("seed_count",uint32_t(0));
     }
     else
@@ -678,6 +711,10 @@ int trk(program_option& po,std::shared_ptr<fib_data> handle)
             tracking_thread.param.termination_count = po.get("seed_count",uint32_t(tracking_thread.param.termination_count));
         tracking_thread.param.stop_by_tract = 0;
     }
+    // the same random_seed and parameters reproduce the same tracts for any thread_count
+    tracking_thread.random_seed = po.get("random_seed",uint32_t(0));
+    // voxel-major fiber table for the tracking threads (see tracking_data::build_packed_table)
+    tracking_thread.use_packed_table = po.get("packed_fib",int(0)) != 0;
 
 
 
@@ -791,8 +828,7 @@ int trk(program_option& po,std::shared_ptr<fib_data> handle)
 
     if(tract_model->get_visible_track_count() && po.has("refine") && (po.get("refine",1) >= 1))
     {
-        for(int i = 0;i < po.get("refine",1);++i)
-            tract_model->trim();
+        tract_model->trim(uint32_t(po.get("refine",1)));
         std::cout << "refine tracking result..." << std::endl;
         std::cout << "convert tracks to seed regions" << std::endl;
         tracking_thread.roi_mgr->seeds.clear();
@@ -836,9 +872,7 @@ int trk(program_option& po,std::shared_ptr<fib_data> handle)
     if(po.has("trim"))
     {
         std::cout << "trimming tracks..." << std::endl;
-        int trim = po.get("trim",int(1));
-        for(int i = 0;i < trim;++i)
-            tract_model->trim();
+        tract_model->trim(uint32_t(po.get("trim",int(1))));
     }
 
     std::string tract_file_name = po.get("source")+".tt.gz";
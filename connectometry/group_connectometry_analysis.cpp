@@ -58,10 +58,9 @@ int group_connectometry_analysis::run_track(std::shared_ptr<tracking_data> fib,
     tracking_thread.param.termination_count = uint32_t(seed_count);
     tracking_thread.roi_mgr = roi_mgr;
     tracking_thread.run(fib,thread_count,true);
-    for(auto& tracts_per_thread : tracking_thread.track_buffer_front)
-        for(auto& tract : tracts_per_thread)
-            if(!tract.empty())
-                tracks.push_back(std::move(tract));
+    for(auto& tract : tracking_thread.track_buffer)
+        if(!tract.empty())
+            tracks.push_back(std::move(tract));
     return int(tracks.size());
 }
 
@@ -117,7 +116,7 @@ void group_connectometry_analysis::run_permutation_multithread(unsigned int id,u
 
         info.resample(*model.get(),null,true,i);
         calculate_spm(data,info,normalize_qa);
-        fib->fa = data.neg_corr_ptr;
+        fib->set_fa(data.neg_corr_ptr);
 
         run_track(fib,neg_tracks,seed_count);
         cal_hist(neg_tracks,(null) ? subject_neg_corr_null : subject_neg_corr);
@@ -125,7 +124,7 @@ void group_connectometry_analysis::run_permutation_multithread(unsigned int id,u
 
         info.resample(*model.get(),null,true,i);
         calculate_spm(data,info,normalize_qa);
-        fib->fa = data.pos_corr_ptr;
+        fib->set_fa(data.pos_corr_ptr);
 
         run_track(fib,pos_tracks,seed_count);
         cal_hist(pos_tracks,(null) ? subject_pos_corr_null : subject_pos_corr);
@@ -188,13 +187,10 @@ void group_connectometry_analysis::run_permutation_multithread(unsigned int id,u
     {
         for(size_t index = 1;index < threads.size();++index)
             threads[index]->wait();
-        for(size_t index = 0;index < tip;++index)
-        {
-            neg_null_corr_track->trim();
-            pos_null_corr_track->trim();
-            neg_corr_track->trim();
-            pos_corr_track->trim();
-        }
+        neg_null_corr_track->trim(uint32_t(tip));
+        pos_null_corr_track->trim(uint32_t(tip));
+        neg_corr_track->trim(uint32_t(tip));
+        pos_corr_track->trim(uint32_t(tip));
         // update fdr table
         std::fill(subject_neg_corr_null.begin(),subject_neg_corr_null.end(),0);
         std::fill(subject_pos_corr_null.begin(),subject_pos_corr_null.end(),0);
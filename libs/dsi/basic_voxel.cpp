@@ -1,6 +1,12 @@
 #include "basic_voxel.hpp"
 #include "image_model.hpp"
 
+void BaseProcess::run_block(Voxel& voxel,VoxelBlock& block)
+{
+    for (size_t index = 0; index < block.size; ++index)
+        run(voxel,block.data[index]);
+}
+
 void Voxel::init(void)
 {
     if(is_histology)
@@ -11,14 +17,22 @@ void Voxel::init(void)
     }
     else
     {
-        voxel_data.resize(thread_count);
+        // signals (space and tile) and ODFs (odf and odf1) held per voxel
+        size_t voxel_bytes = sizeof(float)*(2*bvalues.size()+2*size_t(ti.half_vertices_count));
+        block_size = std::max<size_t>(1,std::min<size_t>(voxel_block_size,voxel_block_bytes/std::max<size_t>(1,voxel_bytes)));
+        voxel_block.clear();
+        voxel_block.resize(thread_count);
         for (unsigned int index = 0; index < thread_count; ++index)
         {
-            voxel_data[index].space.resize(bvalues.size());
-            voxel_data[index].odf.resize(ti.half_vertices_count);
-            voxel_data[index].fa.resize(max_fiber_number);
-            voxel_data[index].dir_index.resize(max_fiber_number);
-            voxel_data[index].dir.resize(max_fiber_number);
+            voxel_block[index].data.resize(block_size);
+            for (auto& data : voxel_block[index].data)
+            {
+                data.space.resize(bvalues.size());
+                data.odf.resize(ti.half_vertices_count);
+                data.fa.resize(max_fiber_number);
+                data.dir_index.resize(max_fiber_number);
+                data.dir.resize(max_fiber_number);
+            }
         }
     }
     for (unsigned int index = 0; index < process_list.size(); ++index)
@@ -48,6 +62,45 @@ void Voxel::load_from_src(ImageModel& image_model)
             dwi_data.push_back(image_model.src_dwi_data[sorted_index[i]]);
         }
 }
+void Voxel::build_dwi_cache(void)
+{
+    if(!dwi_cache.empty() && dwi_cache_version == dwi_version && dwi_cache_key == dwi_data &&
+       dwi_cache_mask.shape() == mask.shape() &&
+       std::equal(mask.begin(),mask.end(),dwi_cache_mask.begin()))
+        return;
+    clear_dwi_cache();
+    std::vector<size_t> voxel_list;
+    for (size_t index = 0; index < mask.size(); ++index)
+        if(mask[index])
+            voxel_list.push_back(index);
+    const size_t dwi_count = dwi_data.size();
+    if(voxel_list.empty() || !dwi_count ||
+       voxel_list.size()*dwi_count*sizeof(unsigned short) > dwi_cache_limit)
+        return;
+    try{
+        dwi_cache.resize(voxel_list.size()*dwi_count);
+    }
+    catch(...)
+    {
+        clear_dwi_cache();
+        return;
+    }
+    // transpose in tiles of voxel_block_size masked voxels
+    tipl::par_for((voxel_list.size()+voxel_block_size-1)/voxel_block_size,[&](size_t block_index)
+    {
+        size_t from = block_index*voxel_block_size;
+        size_t to = std::min<size_t>(from+voxel_block_size,voxel_list.size());
+        for (size_t j = 0; j < dwi_count; ++j)
+        {
+            auto I = dwi_data[j];
+            for (size_t i = from; i < to; ++i)
+                dwi_cache[i*dwi_count+j] = I[voxel_list[i]];
+        }
+    },thread_count);
+    dwi_cache_key = dwi_data;
+    dwi_cache_mask = mask;
+    dwi_cache_version = dwi_version;
+}
 bool Voxel::run_hist(void)
 {
     margin = 16;
@@ -93,12 +146,16 @@ bool Voxel::run_hist(void)
 }
 bool Voxel::run(void)
 {
-    size_t total_voxel = std::accumulate(mask.begin(),mask.end(),size_t(0),[](size_t sum,unsigned char value){return value ? sum+1:sum;});
+    std::vector<size_t> voxel_list;
+    for (size_t index = 0; index < mask.size(); ++index)
+        if(mask[index])
+            voxel_list.push_back(index);
+    size_t block_count = (voxel_list.size()+block_size-1)/block_size;
     size_t total = 0;
     bool terminated = false;
-    tipl::par_for(mask.size(),[&](size_t voxel_index,size_t thread_id)
+    tipl::par_for(block_count,[&](size_t block_index,size_t thread_id)
     {
-        if(terminated || !mask[voxel_index])
+        if(terminated)
             return;
         ++total;
         if(thread_id == 0)
@@ -108,12 +165,19 @@ bool Voxel::run(void)
                 terminated = true;
                 return;
             }
-            progress::at(uint32_t(total*100/total_voxel),100);
+            progress::at(uint32_t(total*100/block_count),100);
+        }
+        auto& block = voxel_block[thread_id];
+        size_t from = block_index*block_size;
+        block.size = std::min<size_t>(block_size,voxel_list.size()-from);
+        for (size_t index = 0; index < block.size; ++index)
+        {
+            block.data[index].init();
+            block.data[index].voxel_index = voxel_list[from+index];
         }
-        voxel_data[thread_id].init();
-        voxel_data[thread_id].voxel_index = voxel_index;
+        block.first = from;
         for (size_t index = 0; index < process_list.size(); ++index)
-            process_list[index]->run(*this,voxel_data[thread_id]);
+            process_list[index]->run_block(*this,block);
     },thread_count);
     return !progress::aborted();
 }
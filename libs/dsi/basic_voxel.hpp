@@ -1,6 +1,7 @@
 #ifndef BASIC_VOXEL_HPP
 #define BASIC_VOXEL_HPP
 #include <string>
+#include <atomic>
 #include "TIPL/tipl.hpp"
 #include "tessellated_icosahedron.hpp"
 #include "gzip_interface.hpp"
@@ -10,6 +11,7 @@ struct ImageModel;
 struct VoxelParam;
 class Voxel;
 struct VoxelData;
+struct VoxelBlock;
 struct HistData;
 class BaseProcess
 {
@@ -17,6 +19,7 @@ public:
     BaseProcess(void) {}
     virtual void init(Voxel&) {}
     virtual void run(Voxel&, VoxelData&) {}
+    virtual void run_block(Voxel&, VoxelBlock&);
     virtual void run_hist(Voxel&,HistData&) {}
     virtual void end(Voxel&,gz_mat_write&) {}
     virtual ~BaseProcess(void) {}
@@ -46,6 +49,19 @@ struct VoxelData
     }
 };
 
+// a tile of contiguous masked voxels processed together, at most voxel_block_size voxels
+// and as many as the per-voxel signals and ODFs allow within voxel_block_bytes per thread
+const unsigned int voxel_block_size = 256;
+const size_t voxel_block_bytes = size_t(1) << 20;
+struct VoxelBlock
+{
+    std::vector<VoxelData> data;
+    std::vector<float> tile; // voxel-major signals gathered by block-aware steps
+    std::vector<float> kernel; // per-voxel kernel scratch (QSDR)
+    size_t size = 0;
+    size_t first = 0; // position of data[0] among the masked voxels
+};
+
 struct HistData
 {
 public:
@@ -79,7 +95,22 @@ public:
     std::vector<const unsigned short*> dwi_data;
     std::vector<tipl::vector<3,float> > bvectors;
     std::vector<float> bvalues;
-
+public:// voxel-major copy of dwi_data over the masked voxels, kept across runs
+    std::vector<unsigned short> dwi_cache;
+    std::vector<const unsigned short*> dwi_cache_key;
+    tipl::image<3,unsigned char> dwi_cache_mask;
+    // bumped by every in-place edit of the DWI volumes (ImageModel::dwi_write_at)
+    std::atomic<size_t> dwi_version{0};
+    size_t dwi_cache_version = 0;
+    size_t dwi_cache_limit = size_t(1) << 30; // bytes
+    void build_dwi_cache(void);
+    void clear_dwi_cache(void)
+    {
+        dwi_cache = std::vector<unsigned short>();
+        dwi_cache_key.clear();
+        dwi_cache_mask.clear();
+    }
+public:
     std::string report,steps;
     std::ostringstream recon_report, step_report;
     unsigned int thread_count = 1;
@@ -150,7 +181,8 @@ public:// for template creation
     std::vector<std::string> template_metrics_name;
     std::string template_file_name;
 public:
-    std::vector<VoxelData> voxel_data;
+    std::vector<VoxelBlock> voxel_block;
+    size_t block_size = voxel_block_size;
     std::vector<HistData> hist_data;
 public:
     template<typename T,typename ...Ts>
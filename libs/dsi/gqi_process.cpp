@@ -29,13 +29,41 @@ void GQI_Recon::calculate_q_vec_t(Voxel& voxel)
         q_vectors_time[index] *= std::sqrt(voxel.bvalues[index]*0.01506f);// get q in (mm) -1
         q_vectors_time[index] *= sigma;
     }
+    float max_q = 0.0f;
+    for (const auto& q : q_vectors_time)
+        max_q = std::max<float>(max_q,float(q.length()));
+    auto kernel = [&](double x){return voxel.r2_weighted ? base_function(x):sinc_pi_imp(x);};
+    for (kernel_table_scale = 1024.0f;;kernel_table_scale *= 2.0f)
+    {
+        kernel_table.resize(size_t(std::ceil(max_q*kernel_table_scale))+2);
+        for (size_t index = 0; index < kernel_table.size(); ++index)
+            kernel_table[index] = float(kernel(double(index)/double(kernel_table_scale)));
+        // the interpolation error peaks between samples
+        double max_error = 0.0;
+        for (size_t index = 0; index+2 < kernel_table.size(); ++index)
+        {
+            float x = (float(index)+0.5f)/kernel_table_scale;
+            max_error = std::max<double>(max_error,std::fabs(double(kernel_at(x))-kernel(double(x))));
+        }
+        if(max_error <= kernel_table_tolerance || kernel_table_scale >= 16384.0f)
+        {
+            if(max_error > kernel_table_tolerance)
+                std::cout << "QSDR kernel table error " << max_error << " exceeds " << kernel_table_tolerance << std::endl;
+            break;
+        }
+    }
 }
 void GQI_Recon::init(Voxel& voxel)
 {
     if(voxel.qsdr)
         calculate_q_vec_t(voxel);
     else
+    {
         calculate_sinc_ql(voxel);
+        sinc_ql_t.resize(sinc_ql.size());
+        tipl::mat::transpose(&*sinc_ql.begin(),&*sinc_ql_t.begin(),
+                             tipl::shape<2>(voxel.ti.half_vertices_count,uint32_t(voxel.bvalues.size())));
+    }
 }
 
 void GQI_Recon::run(Voxel& voxel, VoxelData& data)
@@ -45,27 +73,78 @@ void GQI_Recon::run(Voxel& voxel, VoxelData& data)
     // add rotation from QSDR or gradient nonlinearity
     if(voxel.qsdr)
     {
-        std::vector<float> sinc_ql_(data.odf.size()*data.space.size());
-        for (unsigned int j = 0,index = 0; j < data.odf.size(); ++j)
-        {
-            tipl::vector<3,float> from(voxel.ti.vertices[j]);
-            from.rotate(data.jacobian);
-            from.normalize();
-            if(voxel.r2_weighted)
-                for (unsigned int i = 0; i < data.space.size(); ++i,++index)
-                    sinc_ql_[index] = base_function(q_vectors_time[i]*from);
-            else
-                for (unsigned int i = 0; i < data.space.size(); ++i,++index)
-                    sinc_ql_[index] = sinc_pi_imp(q_vectors_time[i]*from);
-
-        }
-        tipl::mat::vector_product(&*sinc_ql_.begin(),&*data.space.begin(),&*data.odf.begin(),
-                                      tipl::shape<2>(uint32_t(data.odf.size()),uint32_t(data.space.size())));
+        std::vector<float> sinc_ql_;
+        run_qsdr(voxel,data,sinc_ql_);
     }
     else
         tipl::mat::vector_product(&*sinc_ql.begin(),&*data.space.begin(),&*data.odf.begin(),
                                 tipl::shape<2>(uint32_t(data.odf.size()),uint32_t(data.space.size())));
 }
+void GQI_Recon::run_qsdr(Voxel& voxel, VoxelData& data,std::vector<float>& sinc_ql_)
+{
+    sinc_ql_.resize(data.odf.size()*data.space.size());
+    for (unsigned int j = 0,index = 0; j < data.odf.size(); ++j)
+    {
+        tipl::vector<3,float> from(voxel.ti.vertices[j]);
+        from.rotate(data.jacobian);
+        from.normalize();
+        for (unsigned int i = 0; i < data.space.size(); ++i,++index)
+            sinc_ql_[index] = kernel_at(q_vectors_time[i]*from);
+    }
+    tipl::mat::vector_product(&*sinc_ql_.begin(),&*data.space.begin(),&*data.odf.begin(),
+                                  tipl::shape<2>(uint32_t(data.odf.size()),uint32_t(data.space.size())));
+}
 
+void GQI_Recon::run_block(Voxel& voxel, VoxelBlock& block)
+{
+    // QSDR rotates the kernel per voxel, reusing one scratch kernel per block
+    if(voxel.qsdr)
+    {
+        for (size_t v = 0; v < block.size; ++v)
+        {
+            if(voxel.half_sphere)
+                block.data[v].space[0] *= 0.5f;
+            run_qsdr(voxel,block.data[v],block.kernel);
+        }
+        return;
+    }
+    if(sinc_ql_t.empty())
+    {
+        BaseProcess::run_block(voxel,block);
+        return;
+    }
+    const size_t odf_count = voxel.ti.half_vertices_count;
+    const size_t q_count = sinc_ql_t.size()/odf_count;
 
+    // gather the signals into a dense voxel-by-dwi tile
+    block.tile.resize(block.size*q_count);
+    for (size_t v = 0; v < block.size; ++v)
+    {
+        auto& space = block.data[v].space;
+        if(voxel.half_sphere)
+            space[0] *= 0.5f;
+        std::copy(space.begin(),space.begin()+int64_t(q_count),block.tile.begin()+int64_t(v*q_count));
+    }
 
+    // odf = tile * sinc_ql^T, blocked over odf directions so that the kernel
+    // columns stay in cache while the tile streams through; the inner loop is a
+    // contiguous axpy that vectorizes
+    const size_t odf_block = 64;
+    for (size_t j0 = 0; j0 < odf_count; j0 += odf_block)
+    {
+        size_t j_count = std::min(odf_block,odf_count-j0);
+        for (size_t v = 0; v < block.size; ++v)
+        {
+            float* out = &block.data[v].odf[j0];
+            const float* signal = &block.tile[v*q_count];
+            std::fill(out,out+j_count,0.0f);
+            for (size_t i = 0; i < q_count; ++i)
+            {
+                const float* kernel = &sinc_ql_t[i*odf_count+j0];
+                float s = signal[i];
+                for (size_t j = 0; j < j_count; ++j)
+                    out[j] += s*kernel[j];
+            }
+        }
+    }
+}
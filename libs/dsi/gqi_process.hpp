@@ -41,12 +41,29 @@ class GQI_Recon  : public BaseProcess
 public:
     std::vector<tipl::vector<3,float> > q_vectors_time;
     std::vector<float> sinc_ql;
+    std::vector<float> sinc_ql_t; // sinc_ql transposed (dwi-by-odf) for block mode
+private:
+    // QSDR: the kernel is an even function of q*dir, tabulated once (in double,
+    // base_function cancels badly in float near zero) and linearly interpolated.
+    // calculate_q_vec_t checks the table against direct evaluation and refines
+    // the sampling until the error is within kernel_table_tolerance.
+    std::vector<float> kernel_table;
+    float kernel_table_scale = 1024.0f;
+    static constexpr double kernel_table_tolerance = 1e-7;
+    float kernel_at(float x) const
+    {
+        x = std::fabs(x)*kernel_table_scale;
+        auto i = size_t(x);
+        return kernel_table[i]+(kernel_table[i+1]-kernel_table[i])*(x-float(i));
+    }
 private:
     void calculate_sinc_ql(Voxel& voxel);
     void calculate_q_vec_t(Voxel& voxel);
+    void run_qsdr(Voxel& voxel, VoxelData& data,std::vector<float>& kernel);
 public:
     virtual void init(Voxel& voxel) override;
     virtual void run(Voxel& voxel, VoxelData& data) override;
+    virtual void run_block(Voxel& voxel, VoxelBlock& block) override;
 };
 
 class HGQI_Recon  : public BaseProcess
@@ -39,6 +39,7 @@ void ImageModel::draw_mask(tipl::color_image& buffer,int position)
 
 void ImageModel::calculate_dwi_sum(bool update_mask)
 {
+    voxel.clear_dwi_cache();
     if(src_dwi_data.empty())
         return;
     {
@@ -585,7 +586,7 @@ bool ImageModel::command(std::string cmd,std::string param)
                 dwi[index] = 0;
         for(size_t index = 0;index < src_dwi_data.size();++index)
         {
-            unsigned short* buf = const_cast<unsigned short*>(src_dwi_data[index]);
+            unsigned short* buf = &dwi_write_at(index)[0];
             for(size_t i = 0;i < voxel.mask.size();++i)
                 if(voxel.mask[i] == 0)
                     buf[i] = 0;
@@ -726,18 +727,22 @@ void ImageModel::flip_dwi(unsigned char type)
         tipl::par_for(src_dwi_data.size(),[&](unsigned int index)
         {
             progress::at(prog++,src_dwi_data.size());
-            auto I = dwi_at(index);
+            auto I = dwi_write_at(index);
             tipl::flip(I,type);
         });
     }
     voxel.dim = voxel.mask.shape();
 }
 // used in eddy correction for each dwi
-void ImageModel::rotate_one_dwi(unsigned int dwi_index,const tipl::transformation_matrix<double>& T)
+void ImageModel::rotate_one_dwi(unsigned int dwi_index,const tipl::transformation_matrix<double>& T,bool multi_thread)
 {
     tipl::image<3> tmp(voxel.dim);
-    auto I = dwi_at(dwi_index);
-    tipl::resample_mt<tipl::interpolation::cubic>(I,tmp,T);
+    auto I = dwi_write_at(dwi_index);
+    // callers already running one volume per thread pass multi_thread=false
+    if(multi_thread)
+        tipl::resample_mt<tipl::interpolation::cubic>(I,tmp,T);
+    else
+        tipl::resample<tipl::interpolation::cubic>(I,tmp,T);
     tipl::lower_threshold(tmp,0);
     std::copy(tmp.begin(),tmp.end(),I.begin());
     // rotate b-table
@@ -879,7 +884,7 @@ bool ImageModel::align_acpc(void)
     return true;
 }
 
-void ImageModel::correct_motion(bool eddy)
+void ImageModel::correct_motion(bool eddy,bool parallel)
 {
     progress prog_("correcting motion...",true);
     tipl::affine_transform<float> arg;
@@ -889,26 +894,67 @@ void ImageModel::correct_motion(bool eddy)
     arg.translocation[0] = 0.01f;
     arg.translocation[0] = 0.01f;
     arg.translocation[0] = 0.01f;
-    for(unsigned int i = 0;progress::at(i,src_bvalues.size());++i)
+    auto register_dwi = [&](unsigned int i,tipl::affine_transform<float>& cur_arg,std::atomic<bool>& terminated)
     {
         tipl::image<3,unsigned char> to;
         tipl::normalize_upper_lower(dwi_at(i),to);
         tipl::filter::gaussian(to);
         tipl::filter::gaussian(to);
-        bool terminated = false;
         if(src_bvalues[i] > 500.0f)
             tipl::reg::linear_mr<tipl::reg::correlation>(dwi,voxel.vs,to,voxel.vs,
-                                  arg,eddy ? tipl::reg::affine : tipl::reg::rigid_body,
+                                  cur_arg,eddy ? tipl::reg::affine : tipl::reg::rigid_body,
                                   terminated,0.001,tipl::reg::narrow_bound);
         else
             tipl::reg::linear_mr<tipl::reg::mutual_information>(dwi,voxel.vs,to,voxel.vs,
-                              arg,eddy ? tipl::reg::affine : tipl::reg::rigid_body,
+                              cur_arg,eddy ? tipl::reg::affine : tipl::reg::rigid_body,
                               terminated,0.001,tipl::reg::narrow_bound);
-
-        rotate_one_dwi(i,tipl::transformation_matrix<double>(arg,voxel.dim,voxel.vs,
-                                                                     voxel.dim,voxel.vs));
+    };
+    if(!parallel || voxel.thread_count <= 1 || src_bvalues.size() <= 1)
+    {
+        // serial: each volume starts from the estimate of the previous one
+        for(unsigned int i = 0;progress::at(i,src_bvalues.size());++i)
+        {
+            std::atomic<bool> terminated(false);
+            register_dwi(i,arg,terminated);
+            rotate_one_dwi(i,tipl::transformation_matrix<double>(arg,voxel.dim,voxel.vs,
+                                                                         voxel.dim,voxel.vs));
+            std::cout << "registeration at dwi (" << i+1 << "/" << src_bvalues.size() << ")=" << std::endl;
+            std::cout << arg << std::flush;
+        }
+        return;
+    }
+    // parallel (opt-in): the first volume gives a shared initial estimate that
+    // every other volume refines independently, so the result differs from the chain above
+    std::vector<tipl::affine_transform<float> > args(src_bvalues.size());
+    {
+        std::atomic<bool> terminated(false);
+        register_dwi(0,arg,terminated);
+        args[0] = arg;
+    }
+    std::atomic<size_t> prog(0);
+    std::atomic<bool> terminated(false);
+    tipl::par_for(src_bvalues.size()-1,[&](size_t i,unsigned int thread_id)
+    {
+        // progress is reported and polled from the driving thread only
+        if(thread_id == 0 && !progress::at(prog.load(),src_bvalues.size()-1))
+            terminated = true;
+        if(terminated)
+            return;
+        args[i+1] = arg;
+        register_dwi(uint32_t(i+1),args[i+1],terminated);
+        ++prog;
+    },voxel.thread_count);
+    if(terminated)
+        return;
+    tipl::par_for(src_bvalues.size(),[&](size_t i)
+    {
+        rotate_one_dwi(uint32_t(i),tipl::transformation_matrix<double>(args[i],voxel.dim,voxel.vs,
+                                                                               voxel.dim,voxel.vs),false);
+    },voxel.thread_count);
+    for(size_t i = 0;i < args.size();++i)
+    {
         std::cout << "registeration at dwi (" << i+1 << "/" << src_bvalues.size() << ")=" << std::endl;
-        std::cout << arg << std::flush;
+        std::cout << args[i] << std::flush;
     }
 }
 void ImageModel::crop(tipl::shape<3> range_min,tipl::shape<3> range_max)
@@ -919,7 +965,7 @@ void ImageModel::crop(tipl::shape<3> range_min,tipl::shape<3> range_max)
     tipl::par_for(src_dwi_data.size(),[&](unsigned int index)
     {
         progress::at(prog++,src_dwi_data.size());
-        auto I = dwi_at(index);
+        auto I = dwi_write_at(index);
         tipl::image<3,unsigned short> I0;
         tipl::crop(I,I0,range_min,range_max);
         I = 0;
@@ -1863,15 +1909,21 @@ void prepare_idx(const char* file_name,std::shared_ptr<gz_istream> in)
     idx_name += ".idx";
     {
         in->buffer_all = true;
-        if(std::filesystem::exists(idx_name) &&
-           std::filesystem::last_write_time(idx_name) >
-           std::filesystem::last_write_time(file_name))
-        {
+        // a signed index has to match the size and crc of the file, an older one has to be newer
+        if(std::filesystem::exists(idx_name) && in->load_index(idx_name.c_str()) &&
+           (in->index_signed() ? in->index_matches(file_name) :
+                std::filesystem::last_write_time(idx_name) >
+                std::filesystem::last_write_time(file_name)))
             std::cout << "using index file for accelerated loading:" << idx_name << std::endl;
-            in->load_index(idx_name.c_str());
-        }
         else
         {
+            in->clear_index();
+            if(std::filesystem::exists(idx_name))
+            {
+                std::cout << "remove outdated index file: " << idx_name << std::endl;
+                std::error_code ec;
+                std::filesystem::remove(idx_name,ec);
+            }
             if(QFileInfo(file_name).size() > 134217728) // 128mb
             {
                 std::cout << "prepare index file for future accelerated loading" << std::endl;
@@ -1889,7 +1941,7 @@ void save_idx(const char* file_name,std::shared_ptr<gz_istream> in)
     if(in->has_access_points() && in->sample_access_point && !std::filesystem::exists(idx_name))
     {
         std::cout << "saving index file for accelerated loading: " << idx_name << std::endl;
-        in->save_index(idx_name.c_str());
+        in->save_index(idx_name.c_str(),file_name);
     }
 }
 size_t match_template(float volume);
@@ -2093,6 +2145,7 @@ bool ImageModel::load_from_file(const char* dwi_file_name)
                     tipl::add_constant(grad_dev[8].begin(),grad_dev[8].end(),1.0);
                 }
                 // correct signals
+                ++voxel.dwi_version;
                 tipl::par_for(voxel.dim.size(),[&](size_t voxel_index)
                 {
                     tipl::matrix<3,3,float> G;
@@ -246,7 +246,8 @@ public:
     std::vector<const unsigned short*> src_dwi_data;
     tipl::image<3,unsigned char>dwi;
     bool rotated_to_mni = false;
-    tipl::pointer_image<3,unsigned short> dwi_at(size_t index) {return tipl::make_image(const_cast<unsigned short*>(src_dwi_data[index]),voxel.dim);}
+    // writable access to a DWI volume, invalidates the voxel-major cache; read through dwi_at
+    tipl::pointer_image<3,unsigned short> dwi_write_at(size_t index) {++voxel.dwi_version;return tipl::make_image(const_cast<unsigned short*>(src_dwi_data[index]),voxel.dim);}
     tipl::const_pointer_image<3,unsigned short> dwi_at(size_t index) const {return tipl::make_image(src_dwi_data[index],voxel.dim);}
 public:
     void draw_mask(tipl::color_image& buffer,int position);
@@ -270,7 +271,7 @@ public:
     void flip_b_table(unsigned char dim);
     void swap_b_table(unsigned char dim);
     void flip_dwi(unsigned char type);
-    void rotate_one_dwi(unsigned int dwi_index,const tipl::transformation_matrix<double>& affine);
+    void rotate_one_dwi(unsigned int dwi_index,const tipl::transformation_matrix<double>& affine,bool multi_thread = true);
     void rotate(const tipl::shape<3>& new_geo,
                 const tipl::vector<3>& new_vs,
                 const tipl::transformation_matrix<double>& affine,
@@ -281,7 +282,7 @@ public:
     bool align_acpc(void);
     void crop(tipl::shape<3> range_min,tipl::shape<3> range_max);
     void trim(void);
-    void correct_motion(bool eddy);
+    void correct_motion(bool eddy,bool parallel = false);
 public:
     std::shared_ptr<ImageModel> rev_pe_src;
     tipl::shape<3> topup_from,topup_to;
@@ -5,13 +5,36 @@
 
 class ReadDWIData : public BaseProcess{
 public:
-    virtual void init(Voxel&) {}
+    virtual void init(Voxel& voxel)
+    {
+        voxel.build_dwi_cache();
+    }
     virtual void run(Voxel& voxel, VoxelData& data)
     {
         data.space.resize(voxel.dwi_data.size());
         for (unsigned int index = 0; index < data.space.size(); ++index)
             data.space[index] = voxel.dwi_data[index][data.voxel_index];
     }
+    virtual void run_block(Voxel& voxel, VoxelBlock& block)
+    {
+        const size_t dwi_count = voxel.dwi_data.size();
+        if(!voxel.dwi_cache.empty())
+        {
+            auto row = voxel.dwi_cache.begin()+int64_t(block.first*dwi_count);
+            for (size_t i = 0; i < block.size; ++i,row += int64_t(dwi_count))
+                block.data[i].space.assign(row,row+int64_t(dwi_count));
+            return;
+        }
+        // read one volume at a time so that each DWI is visited in a short forward run
+        for (size_t i = 0; i < block.size; ++i)
+            block.data[i].space.resize(voxel.dwi_data.size());
+        for (size_t index = 0; index < voxel.dwi_data.size(); ++index)
+        {
+            auto I = voxel.dwi_data[index];
+            for (size_t i = 0; i < block.size; ++i)
+                block.data[i].space[index] = I[block.data[i].voxel_index];
+        }
+    }
     virtual void end(Voxel&,gz_mat_write&) {}
 };
 
@@ -577,12 +600,14 @@ struct ODFShaping
 };
 struct SearchLocalMaximum
 {
-    std::vector<std::vector<unsigned short> > neighbor;
+    // neighbors of vertex i are neighbor_list[neighbor_pos[i]..neighbor_pos[i+1])
+    std::vector<unsigned int> neighbor_pos;
+    std::vector<unsigned short> neighbor_list;
     void init(Voxel& voxel)
     {
         unsigned int half_odf_size = voxel.ti.half_vertices_count;
         unsigned int faces_count = uint32_t(voxel.ti.faces.size());
-        neighbor.resize(voxel.ti.half_vertices_count);
+        std::vector<std::vector<unsigned short> > neighbor(half_odf_size);
         for (unsigned int index = 0;index < faces_count;++index)
         {
             unsigned short i1 = voxel.ti.faces[index][0];
@@ -601,26 +626,54 @@ struct SearchLocalMaximum
             neighbor[i3].push_back(i1);
             neighbor[i3].push_back(i2);
         }
+        neighbor_pos.resize(half_odf_size+1);
+        neighbor_list.clear();
+        for (unsigned int index = 0;index < half_odf_size;++index)
+        {
+            // every edge is shared by two faces
+            std::sort(neighbor[index].begin(),neighbor[index].end());
+            neighbor[index].erase(std::unique(neighbor[index].begin(),neighbor[index].end()),neighbor[index].end());
+            neighbor_pos[index] = uint32_t(neighbor_list.size());
+            neighbor_list.insert(neighbor_list.end(),neighbor[index].begin(),neighbor[index].end());
+        }
+        neighbor_pos[half_odf_size] = uint32_t(neighbor_list.size());
     }
-    void search(const std::vector<float>& old_odf,std::map<float,unsigned short,std::greater<float> >& max_table)
-    {
-        max_table.clear();
-        for (uint32_t index = 0;index < neighbor.size();++index)
+    // writes the largest local maxima in descending order into peak_value/peak_index
+    // (at most max_count) and returns the number found. Equal values keep the last
+    // vertex, as a value-keyed map would.
+    unsigned int search(const float* odf,unsigned int max_count,float* peak_value,unsigned short* peak_index) const
+    {
+        unsigned int count = 0;
+        const unsigned int odf_size = uint32_t(neighbor_pos.size())-1;
+        for (unsigned int index = 0;index < odf_size;++index)
         {
-            float value = old_odf[index];
+            float value = odf[index];
             bool is_max = true;
-            std::vector<uint16_t>& nei = neighbor[index];
-            for (unsigned int j = 0;j < nei.size();++j)
+            for (unsigned int j = neighbor_pos[index];j < neighbor_pos[index+1];++j)
+                is_max &= !(value < odf[neighbor_list[j]]);
+            if (!is_max)
+                continue;
+            unsigned int pos = 0;
+            while(pos < count && peak_value[pos] > value)
+                ++pos;
+            if(pos < count && peak_value[pos] == value)
             {
-                if (value < old_odf[nei[j]])
-                {
-                    is_max = false;
-                    break;
-                }
+                peak_index[pos] = uint16_t(index);
+                continue;
+            }
+            if(pos >= max_count)
+                continue;
+            if(count < max_count)
+                ++count;
+            for (unsigned int j = count-1;j > pos;--j)
+            {
+                peak_value[j] = peak_value[j-1];
+                peak_index[j] = peak_index[j-1];
             }
-            if (is_max)
-                max_table[value] = index;
+            peak_value[pos] = value;
+            peak_index[pos] = uint16_t(index);
         }
+        return count;
     }
 };
 
@@ -643,7 +696,8 @@ public:
         data.min_odf = tipl::min_value(data.odf);
         if(voxel.odf_resolving)
         {
-            std::vector<float> odf(data.odf);
+            auto& odf = data.odf1;
+            odf.assign(data.odf.begin(),data.odf.end());
             tipl::minus_constant(odf,data.min_odf);
             float sum = std::accumulate(odf.begin(),odf.end(),0.0f);
             float last_fiber_sum = 0.0f;
@@ -688,15 +742,9 @@ public:
         }
         else
         {
-            std::map<float,unsigned short,std::greater<float> > max_table;
-            lm.search(data.odf,max_table);
-            auto iter = max_table.begin();
-            auto end = max_table.end();
-            for (unsigned int index = 0;iter != end && index < voxel.max_fiber_number;++index,++iter)
-            {
-                data.dir_index[index] = iter->second;
-                data.fa[index] = iter->first - data.min_odf;
-            }
+            unsigned int count = lm.search(&data.odf[0],voxel.max_fiber_number,&data.fa[0],&data.dir_index[0]);
+            for (unsigned int index = 0;index < count;++index)
+                data.fa[index] -= data.min_odf;
         }
 
     }
@@ -1,6 +1,8 @@
 #include <stdexcept>
 #include <chrono>
 #include <stdio.h>
+#include <QFile>
+#include <QString>
 #include "gzip_interface.hpp"
 #include "prog_interface_static_link.h"
 #define SPAN 8388608L       /* 8MB as the desired distance between access points */
@@ -36,6 +38,7 @@ inflate_stream::inflate_stream(std::shared_ptr<access_point> point)
     if (inflateInit2(&strm, -15) != Z_OK)
         throw std::runtime_error("inflateInit2 failed");
     inflateSetDictionary(&strm,point->dict32k, WINSIZE);
+    gzip_wrapper = false;
 }
 
 inflate_stream::~inflate_stream()
@@ -46,6 +49,10 @@ int inflate_stream::process(void)
 {
     return inflate( &strm, Z_NO_FLUSH);
 }
+bool inflate_stream::next_member(void)
+{
+    return gzip_wrapper && inflateReset(&strm) == Z_OK;
+}
 int inflate_stream::process(size_t& cur_uncompressed,size_t& cur_compressed,bool get_access_point)
 {
     cur_uncompressed += strm.avail_out;
@@ -243,9 +250,67 @@ bool gz_istream::fetch(void)
 }
 void gz_istream::flush(void)
 {
-    for(auto thread: inflate_thread)
-        thread->wait();
-    inflate_thread.clear();
+    // inflation always completes within read()
+}
+bool gz_istream::wait_file_buf(size_t last_index)
+{
+    for(size_t i = cur_input_index;i <= last_index;++i)
+        if(!file_buf_ready[i])
+        {
+            terminate_readfile_thread();
+            if(!read_each_buf(cur_input_index,last_index-cur_input_index+1))
+                return false;
+            break;
+        }
+    for(size_t i = cur_input_index;i <= last_index;++i)
+        if(!file_buf_ready[i])
+            return false;
+    return true;
+}
+// inflate the ranges between consecutive access points on separate threads.
+// The first range continues the current stream and the others start from a point.
+bool gz_istream::read_segments(unsigned char* buf,const std::vector<std::shared_ptr<access_point> >& seg)
+{
+    size_t from_uncompressed = cur_uncompressed;
+    std::vector<char> ok(seg.size());
+    tipl::par_for(seg.size(),[&](size_t k)
+    {
+        auto strm = k ? std::make_shared<inflate_stream>(seg[k-1]) : istrm;
+        size_t from = k ? seg[k-1]->uncompressed_pos : from_uncompressed;
+        size_t index = k ? seg[k-1]->compressed_pos/WINSIZE : cur_input_index;
+        size_t shift = k ? seg[k-1]->compressed_pos%WINSIZE : cur_input_shift;
+        // the buffer holding the end point is the last one made ready by wait_file_buf.
+        // Those after it may still be filled by the reading thread.
+        size_t last = seg[k]->compressed_pos/WINSIZE;
+        strm->output(buf+from-from_uncompressed,seg[k]->uncompressed_pos-from);
+        if(strm->empty() && index < file_buf.size())
+        {
+            strm->input(file_buf[index++]);
+            strm->shift_input(shift);
+        }
+        int ret = Z_OK;
+        while(ret == Z_OK && strm->size_to_extract())
+        {
+            if(strm->empty())
+            {
+                if(index > last || index >= file_buf.size())
+                    break;
+                strm->input(file_buf[index++]);
+            }
+            ret = strm->process();
+        }
+        ok[k] = (strm->size_to_extract() == 0);
+    });
+    if(std::find(ok.begin(),ok.end(),0) != ok.end())
+        return false;
+    // all buffers before the last point are consumed. The one holding the point is still needed
+    if(free_on_read)
+        for(size_t i = cur_input_index;i < seg.back()->compressed_pos/WINSIZE;++i)
+        {
+            std::vector<unsigned char>().swap(file_buf[i]);
+            file_buf_ready[i] = false;
+        }
+    return jump_to(seg.back());
 }
 
 bool gz_istream::read(void* buf,size_t len)
@@ -276,52 +341,17 @@ bool gz_istream::read(void* buf,size_t len)
     // consider multiple thread reading, at least 64x32K=2MB, has jump points
     if(len > (WINSIZE << 6) && !sample_access_point && !points.empty())
     {
-        auto result = points.lower_bound(cur_uncompressed+len);
-        if(result != points.end() && result->first > cur_uncompressed)
+        std::vector<std::shared_ptr<access_point> > seg;
+        for(auto iter = points.lower_bound(cur_uncompressed+len-1);iter != points.end() && iter->first > cur_uncompressed;++iter)
+            seg.push_back(iter->second);
+        std::reverse(seg.begin(),seg.end());
+        if(!seg.empty() && wait_file_buf(seg.back()->compressed_pos/WINSIZE))
         {
-            auto& point = result->second;
-            size_t byte_to_skip = point->uncompressed_pos - cur_uncompressed; // this value is between 0 and len
-            size_t next_file_buf_index = point->compressed_pos/WINSIZE;
-
-            // check if all file buffer are ready to be inflated
-            bool data_ready = true;
-            for(size_t i = cur_input_index;i <= next_file_buf_index;++i)
-                if(!file_buf_ready[i])
-                {
-                    //std::cout << "WAIT FOR DISK READING" << std::endl;
-                    data_ready = false;
-                    break;
-                }
-            if(data_ready)
-            {
-                //std::cout << "MULTITHREAD GZ" << std::endl;
-                auto back_upstrm = istrm;
-                back_upstrm->output(buf,byte_to_skip);
-                size_t index = cur_input_index;
-
-                // start a new thread to inflate data
-                inflate_thread.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,[this,back_upstrm,index] () mutable
-                {
-                    do{
-                        if(back_upstrm->empty())
-                        {
-                            if(free_on_read)
-                            {
-                                file_buf_ready[index] = false;
-                                back_upstrm->input(std::move(file_buf[index++]));
-                            }
-                            else
-                                back_upstrm->input(file_buf[index++]);
-                        }
-                    }while(back_upstrm->process() == Z_OK && back_upstrm->size_to_extract());
-                    back_upstrm.reset(); // if not reset, the memory will stay with inflate_thread
-                })));
-
-                // now we can jump to the next access point and read it from there
-                if(!jump_to(point))
-                    return false;
-                return read(reinterpret_cast<unsigned char *>(buf)+byte_to_skip,len-byte_to_skip);
-            }
+            size_t byte_to_skip = seg.back()->uncompressed_pos - cur_uncompressed; // this value is between 0 and len
+            if(!read_segments(reinterpret_cast<unsigned char *>(buf),seg))
+                return false;
+            progress::at(cur_compressed*100/file_size,100);
+            return read(reinterpret_cast<unsigned char *>(buf)+byte_to_skip,len-byte_to_skip);
         }
     }
 
@@ -346,7 +376,17 @@ bool gz_istream::read(void* buf,size_t len)
 
         if(ret == Z_STREAM_END)
         {
-            flush();
+            // concatenated gzip members continue the same stream
+            if(istrm->has_gzip_wrapper() && cur_compressed < file_size &&
+               (!istrm->empty() || fetch()) && istrm->next_input() == 0x1f && istrm->next_member())
+            {
+                // access points are only valid within a single member
+                sample_access_point = false;
+                get_access_point = false;
+                buf32k = nullptr;
+                points.clear();
+                continue;
+            }
             if(free_on_read)
             {
                 file_buf.clear();
@@ -418,12 +458,25 @@ bool gz_istream::seek(size_t offset)
     std::vector<unsigned char> discard(offset-cur_uncompressed);
     return read(&discard[0],discard.size());
 }
+bool get_idx_signature(const char* gz_file_name,std::shared_ptr<access_point>& signature)
+{
+    std::ifstream in(gz_file_name,std::ios::binary|std::ios::ate);
+    if(!in || in.tellg() < 18)
+        return false;
+    signature = std::make_shared<access_point>();
+    std::fill(signature->dict32k,signature->dict32k+WINSIZE,0);
+    signature->compressed_pos = idx_signature_pos;
+    signature->uncompressed_pos = uint64_t(in.tellg());
+    in.seekg(-8,std::ios::end);
+    in.read(reinterpret_cast<char*>(signature->dict32k),8);
+    return bool(in);
+}
 bool gz_istream::load_index(const char* file_name)
 {
     std::ifstream in(file_name,std::ios::binary);
     if(!in)
         return false;
-    points.clear();
+    clear_index();
     while(in)
     {
         std::shared_ptr<access_point> p(new access_point);
@@ -432,12 +485,27 @@ bool gz_istream::load_index(const char* file_name)
             break;
         in.read(reinterpret_cast<char*>(&p->uncompressed_pos),sizeof(uint64_t));
         in.read(reinterpret_cast<char*>(p->dict32k),WINSIZE);
-        points[p->uncompressed_pos] = p;
+        if(!in)
+            break;
+        if(p->compressed_pos == idx_signature_pos)
+            signature = p;
+        else
+            points[p->uncompressed_pos] = p;
     }
     return true;
 }
-bool gz_istream::save_index(const char* file_name)
+bool gz_istream::index_matches(const char* gz_file_name) const
+{
+    std::shared_ptr<access_point> cur;
+    return signature.get() && get_idx_signature(gz_file_name,cur) &&
+           cur->uncompressed_pos == signature->uncompressed_pos &&
+           std::equal(cur->dict32k,cur->dict32k+8,signature->dict32k);
+}
+bool gz_istream::save_index(const char* file_name,const char* gz_file_name)
 {
+    std::shared_ptr<access_point> cur;
+    if(!get_idx_signature(gz_file_name,cur))
+        return false;
     std::ofstream out(file_name,std::ios::binary);
     if(!out)
         return false;
@@ -447,6 +515,9 @@ bool gz_istream::save_index(const char* file_name)
         out.write(reinterpret_cast<char*>(&iter.second->uncompressed_pos),sizeof(uint64_t));
         out.write(reinterpret_cast<char*>(iter.second->dict32k),WINSIZE);
     }
+    out.write(reinterpret_cast<char*>(&cur->compressed_pos),sizeof(uint64_t));
+    out.write(reinterpret_cast<char*>(&cur->uncompressed_pos),sizeof(uint64_t));
+    out.write(reinterpret_cast<char*>(cur->dict32k),WINSIZE);
     return true;
 }
 void gz_istream::close(void)
@@ -460,58 +531,234 @@ void gz_istream::close(void)
 
 
 
-bool gz_ostream::open(const char* file_name)
+bool gz_ostream::open(const char* file_name_)
 {
-    if(is_gz(file_name))
+    close();
+    file_name = file_name_;
+    is_gz_file = is_gz(file_name_);
+    write_failed = false;
+    // only fib, src, and tt files are read through an index
+    write_index = is_gz_file && (QString(file_name_).endsWith(".fib.gz") ||
+                                 QString(file_name_).endsWith(".src.gz") ||
+                                 QString(file_name_).endsWith(".tt.gz"));
+    out.open(file_name_,std::ios::binary);
+    if(!out)
+        return false;
+    if(is_gz_file)
     {
-        handle = gzopen(file_name, "wb");
         std::string idx_name(file_name);
         idx_name += ".idx";
         if(std::ifstream(idx_name.c_str(),std::ios::binary))
             ::remove(idx_name.c_str());
-        return handle;
+        // gzip header: deflate, no file name, unknown OS
+        const unsigned char header[10] = {0x1f,0x8b,8,0,0,0,0,0,0,255};
+        out.write(reinterpret_cast<const char*>(header),sizeof(header));
+        compressed_pos = sizeof(header);
+        uncompressed_pos = 0;
+        crc = uint32_t(crc32(0L,Z_NULL,0));
+        dict32k.clear();
+        points.clear();
     }
-    out.open(file_name,std::ios::binary);
     return out.good();
 }
+void gz_ostream::write_block(block_type& block)
+{
+    // a block start is an access point when a full 32K dictionary precedes it
+    if(block.size && block.dict->size() == WINSIZE)
+        points.push_back(std::make_shared<access_point>(block.uncompressed_pos,compressed_pos,block.dict->data()));
+    std::vector<unsigned char> result;
+    try{
+        result = block.result.get();
+    }
+    catch(...)
+    {
+        write_failed = true;
+    }
+    if(write_failed)
+        return;
+    out.write(reinterpret_cast<const char*>(result.data()),std::streamsize(result.size()));
+    if(!out || result.empty())
+    {
+        write_failed = true;
+        return;
+    }
+    compressed_pos += result.size();
+    crc = uint32_t(crc32_combine(crc,block.crc,z_off_t(block.size)));
+}
+void gz_ostream::submit(bool finish)
+{
+    if(cur_block.empty() && !finish)
+        return;
+    block_type block;
+    block.size = cur_block.size();
+    block.uncompressed_pos = uncompressed_pos;
+    block.crc = uint32_t(crc32(0L,cur_block.data(),uInt(cur_block.size())));
+    block.dict = std::make_shared<std::vector<unsigned char> >(dict32k);
+    uncompressed_pos += cur_block.size();
+
+    auto data = std::make_shared<std::vector<unsigned char> >(std::move(cur_block));
+    dict32k.insert(dict32k.end(),data->end()-long(std::min<size_t>(WINSIZE,data->size())),data->end());
+    if(dict32k.size() > WINSIZE)
+        dict32k.erase(dict32k.begin(),dict32k.end()-WINSIZE);
+
+    int level = compression_level;
+    auto dict = block.dict;
+    auto compress = [data,dict,finish,level](void)
+    {
+        std::vector<unsigned char> result;
+        z_stream strm;
+        strm.zalloc = nullptr;
+        strm.zfree = nullptr;
+        strm.opaque = nullptr;
+        if(deflateInit2(&strm,level,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) != Z_OK)
+            return result;
+        if(!dict->empty())
+            deflateSetDictionary(&strm,dict->data(),uInt(dict->size()));
+        result.resize(deflateBound(&strm,uLong(data->size()))+16);
+        strm.next_in = data->data();
+        strm.avail_in = uInt(data->size());
+        strm.next_out = result.data();
+        strm.avail_out = uInt(result.size());
+        // sync flush ends the block on a byte boundary so that inflate can start at the next one
+        deflate(&strm,finish ? Z_FINISH : Z_SYNC_FLUSH);
+        result.resize(result.size()-strm.avail_out);
+        deflateEnd(&strm);
+        return result;
+    };
+    try{
+        block.result = std::async(std::launch::async,compress);
+    }
+    catch(...) // no thread available: compress when the block is written
+    {
+        block.result = std::async(std::launch::deferred,compress);
+    }
+    compressing.push_back(std::move(block));
+    cur_block = std::vector<unsigned char>();
+    // keep at most one block per thread in flight, written in order
+    while(compressing.size() > std::max<size_t>(1,std::thread::hardware_concurrency()))
+    {
+        write_block(compressing.front());
+        compressing.pop_front();
+    }
+}
 void gz_ostream::write(const void* buf_,size_t size)
 {
     const char* buf = reinterpret_cast<const char*>(buf_);
-    if(handle)
+    if(!is_gz_file)
     {
-        const size_t block_size = 104857600;// 100mb
-        while(size > block_size)
-        {
-            if(gzwrite(handle,buf,block_size) <= 0)
-            {
-                close();
-                throw std::runtime_error("Cannot output gz file");
-            }
-            size -= block_size;
-            buf = buf + block_size;
-        }
-        if(gzwrite(handle,buf,uint32_t(size)) <= 0)
-            close();
-    }
-    else
         if(out)
-            out.write(buf,uint32_t(size));
+            out.write(buf,std::streamsize(size));
+        return;
+    }
+    while(size)
+    {
+        if(cur_block.empty())
+            cur_block.reserve(block_size);
+        size_t copy_size = std::min<size_t>(size,block_size-cur_block.size());
+        cur_block.insert(cur_block.end(),buf,buf+copy_size);
+        buf += copy_size;
+        size -= copy_size;
+        if(cur_block.size() >= block_size)
+            submit(false);
+    }
 }
 void gz_ostream::flush(void)
 {
-    if(handle)
-        gzflush(handle,Z_FULL_FLUSH);
-    else
+    if(is_gz_file)
+    {
+        submit(false);
+        for(auto& block : compressing)
+            write_block(block);
+        compressing.clear();
+    }
     if(out)
         out.flush();
 }
 void gz_ostream::close(void)
 {
-    if(handle)
+    if(!out.is_open())
+        return;
+    if(is_gz_file)
     {
-        gzclose(handle);
-        handle = nullptr;
+        submit(true);
+        for(auto& block : compressing)
+            write_block(block);
+        compressing.clear();
+        // gzip trailer: crc32 and uncompressed size modulo 2^32, little endian
+        unsigned char trailer[8];
+        for(int i = 0;i < 4;++i)
+        {
+            trailer[i] = uint8_t(crc >> (8*i));
+            trailer[i+4] = uint8_t(uncompressed_pos >> (8*i));
+        }
+        out.write(reinterpret_cast<const char*>(trailer),sizeof(trailer));
     }
-    if(out)
-        out.close();
+    out.close();
+    if(write_failed || out.fail())
+        write_failed = true;
+    else
+    if(is_gz_file && write_index && !points.empty())
+    {
+        // same layout as gz_istream::save_index, written after the data file
+        std::string idx_name(file_name);
+        idx_name += ".idx";
+        std::shared_ptr<access_point> signature;
+        if(get_idx_signature(file_name.c_str(),signature))
+        {
+            points.push_back(signature);
+            std::ofstream idx(idx_name.c_str(),std::ios::binary);
+            for(auto& p : points)
+            {
+                idx.write(reinterpret_cast<const char*>(&p->compressed_pos),sizeof(uint64_t));
+                idx.write(reinterpret_cast<const char*>(&p->uncompressed_pos),sizeof(uint64_t));
+                idx.write(reinterpret_cast<const char*>(p->dict32k),WINSIZE);
+            }
+        }
+    }
+    points.clear();
+    is_gz_file = false;
+}
+
+bool gz_mat_read::map_file(const char* file_name)
+{
+    if(QString(file_name).endsWith(".gz"))
+        return false;
+    auto file = std::make_shared<QFile>(file_name);
+    if(!file->open(QIODevice::ReadOnly))
+        return false;
+    // copy-on-write: callers may still edit what they read (e.g. background removal, flipping),
+    // which then only touches private copies of the affected pages
+    const unsigned char* data = file->map(0,file->size(),QFileDevice::MapPrivateOption);
+    if(!data)
+        return false;
+    // MAT v4: type, rows, cols, imagf, name length, followed by the name and the data
+    const unsigned int element_size[6] = {8,4,4,2,2,1};
+    uint64_t file_size = uint64_t(file->size());
+    for(uint64_t pos = 0;pos+20 <= file_size;)
+    {
+        uint32_t header[5];
+        std::copy(data+pos,data+pos+20,reinterpret_cast<unsigned char*>(header));
+        uint32_t precision = (header[0]%100)/10;
+        if(header[0] >= 1000 || precision > 5 || header[4] == 0) // only little endian real matrices
+            break;
+        uint64_t name_pos = pos+20;
+        uint64_t data_pos = name_pos+header[4];
+        if(data_pos > file_size)
+            break;
+        uint64_t remaining = file_size-data_pos;
+        uint64_t element_count = uint64_t(header[1])*uint64_t(header[2]);
+        uint64_t element_bytes = element_size[precision]*(header[3] ? 2:1);
+        if(element_count > remaining/element_bytes)
+            break;
+        uint64_t data_size = element_count*element_bytes;
+        if(!header[3])
+        {
+            std::string name(reinterpret_cast<const char*>(data+name_pos),header[4]);
+            name.resize(std::min(name.size(),name.find('\0')));
+            mapped[name] = mapped_matrix{header[0]%100,header[1],header[2],data+data_pos};
+        }
+        pos = data_pos+data_size;
+    }
+    mapped_file = file;
+    return true;
 }
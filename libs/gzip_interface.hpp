@@ -3,6 +3,10 @@
 #include "zlib.h"
 #include "TIPL/tipl.hpp"
 #include <stdio.h>
+#include <deque>
+#include <map>
+#include <future>
+#include <mutex>
 
 #define WINSIZE 32768U      /* sliding window size */
 
@@ -20,9 +24,15 @@ struct access_point {
     }
 };
 
+// an .idx file ends with a signature record, marked by idx_signature_pos, that holds the
+// size and the gzip trailer (crc32 and length) of the indexed file
+const uint64_t idx_signature_pos = ~uint64_t(0);
+bool get_idx_signature(const char* gz_file_name,std::shared_ptr<access_point>& signature);
+
 class inflate_stream{
     z_stream strm;
     bool ok = true;
+    bool gzip_wrapper = true; // false for raw streams started at an access point
     std::vector<unsigned char> buf;
 public:
     inflate_stream(void);
@@ -33,6 +43,7 @@ private: // no copy of the class
     void operator=(const inflate_stream& rhs);
 public:
     int process(void);
+    bool next_member(void);
     int process(size_t& cur_uncompressed,size_t& cur_compressed,bool get_access_point);
     void input(const std::vector<unsigned char>& rhs);
     void input(std::vector<unsigned char>&& rhs);
@@ -54,6 +65,14 @@ public:
         strm.avail_in -= shift;
         strm.next_in += shift;
     }
+    bool has_gzip_wrapper(void) const
+    {
+        return gzip_wrapper;
+    }
+    unsigned char next_input(void) const
+    {
+        return *strm.next_in;
+    }
 };
 
 
@@ -73,8 +92,6 @@ private:
     bool terminated = false;
     bool reading_buf = false;
     bool read_each_buf(size_t begin_index,size_t n);
-private:
-    std::vector<std::shared_ptr<std::future<void> > > inflate_thread;
 private:
     std::vector<std::vector<unsigned char> > file_buf;
     std::vector<bool> file_buf_ready;
@@ -84,15 +101,21 @@ private:
 private:
     std::map<uint64_t,std::shared_ptr<access_point>,std::greater<uint64_t> > points;
     std::vector<access_point> access;
+    std::shared_ptr<access_point> signature;
     void initgz(void);
     void terminate_readfile_thread(void);
     bool jump_to(std::shared_ptr<access_point> p);
+    bool wait_file_buf(size_t last_index);
+    bool read_segments(unsigned char* buf,const std::vector<std::shared_ptr<access_point> >& seg);
 public:
     bool sample_access_point = false;
     bool buffer_all = false;
     bool free_on_read = true;
     bool load_index(const char* file_name);
-    bool save_index(const char* file_name);
+    bool save_index(const char* file_name,const char* gz_file_name);
+    bool index_matches(const char* gz_file_name) const;
+    bool index_signed(void) const {return signature.get();}
+    void clear_index(void) {points.clear();signature.reset();}
     bool has_access_points(void) const {return !points.empty();}
 public:
     ~gz_istream(void){close();}
@@ -114,9 +137,32 @@ public:
     bool operator!() const	{return !good();}
 };
 
+// .gz output is deflated in blocks on worker threads, pigz style: a single gzip member
+// whose blocks are byte-aligned and primed with the preceding 32K, so that each block
+// start is an access point. For fib, src, and tt files the points are saved as the .idx
+// file read by gz_istream.
 class gz_ostream{
     std::ofstream out;
-    gzFile handle;
+    bool is_gz_file = false;
+    bool write_index = false;
+    bool write_failed = false;  // I/O errors are reported through good(), never thrown
+    std::string file_name;
+    struct block_type{
+        std::future<std::vector<unsigned char> > result;
+        std::shared_ptr<std::vector<unsigned char> > dict;
+        uint64_t uncompressed_pos = 0;
+        uint32_t crc = 0;
+        size_t size = 0;
+    };
+    std::deque<block_type> compressing;
+    std::vector<unsigned char> cur_block;
+    std::vector<unsigned char> dict32k;     // up to the last 32K of the uncompressed data
+    std::vector<std::shared_ptr<access_point> > points;
+    uint64_t compressed_pos = 0;
+    uint64_t uncompressed_pos = 0;
+    uint32_t crc = 0;
+    void submit(bool finish);
+    void write_block(block_type& block);
     bool is_gz(const char* file_name)
     {
         std::string filename = file_name;
@@ -128,7 +174,12 @@ class gz_ostream{
         return false;
     }
 public:
-    gz_ostream(void):handle(nullptr){}
+    int compression_level = Z_DEFAULT_COMPRESSION;
+    size_t block_size = 8388608;    // uncompressed bytes per block, also the access point spacing
+public:
+    gz_ostream(void){}
+    gz_ostream(int compression_level_,size_t block_size_):
+        compression_level(compression_level_),block_size(std::max<size_t>(WINSIZE,block_size_)){}
     ~gz_ostream(void)
     {
         close();
@@ -138,7 +189,7 @@ public:
     void write(const void* buf_,size_t size);
     void flush(void);
     void close(void);
-    bool good(void) const {return handle ? !gzeof(handle):out.good();}
+    bool good(void) const {return !write_failed && out.good();}
     operator bool() const	{return good();}
     bool operator!() const	{return !good();}
 
@@ -147,6 +198,63 @@ public:
 
 typedef tipl::io::nifti_base<gz_istream,gz_ostream> gz_nifti;
 typedef tipl::io::mat_write_base<gz_ostream> gz_mat_write;
-typedef tipl::io::mat_read_base<gz_istream> gz_mat_read;
+class QFile;
+// Uncompressed MAT v4 files are also mapped into memory (copy-on-write). Matrices
+// stored in the requested type are then handed out as pointers into the mapping
+// without a copy, and unmodified pages are shared with other processes reading
+// the same file.
+class gz_mat_read : public tipl::io::mat_read_base<gz_istream>{
+    using base_type = tipl::io::mat_read_base<gz_istream>;
+    struct mapped_matrix{
+        uint32_t type,rows,cols;
+        const unsigned char* data;
+    };
+    std::shared_ptr<QFile> mapped_file;
+    std::map<std::string,mapped_matrix> mapped;
+    bool map_file(const char* file_name);
+    template<class T>
+    bool read_mapped(const std::string& name,unsigned int& rows,unsigned int& cols,const T*& out) const
+    {
+        auto iter = mapped.find(name);
+        if(iter == mapped.end() || iter->second.type != uint32_t(tipl::io::mat_type_info<T>::type) ||
+           reinterpret_cast<uintptr_t>(iter->second.data) % alignof(T))
+            return false;
+        rows = iter->second.rows;
+        cols = iter->second.cols;
+        out = reinterpret_cast<const T*>(iter->second.data);
+        return true;
+    }
+public:
+    // serializes delayed reads, which seek the shared stream
+    std::shared_ptr<std::mutex> read_mutex = std::make_shared<std::mutex>();
+public:
+    using base_type::read;
+    bool load_from_file(const char* file_name)
+    {
+        mapped_file.reset();
+        mapped.clear();
+        if(!base_type::load_from_file(file_name))
+            return false;
+        map_file(file_name);
+        return true;
+    }
+    template<class T>
+    bool read(const char* name,unsigned int& rows,unsigned int& cols,const T*& out)
+    {
+        return read_mapped(name,rows,cols,out) || base_type::read(name,rows,cols,out);
+    }
+    template<class T>
+    bool read(unsigned int index,unsigned int& rows,unsigned int& cols,const T*& out)
+    {
+        return (index < size() && read_mapped(name(index),rows,cols,out)) || base_type::read(index,rows,cols,out);
+    }
+    void swap(gz_mat_read& rhs)
+    {
+        base_type::swap(rhs);
+        mapped_file.swap(rhs.mapped_file);
+        mapped.swap(rhs.mapped);
+        read_mutex.swap(rhs.read_mutex);
+    }
+};
 
 #endif // GZIP_INTERFACE_HPP
@@ -10,9 +10,21 @@
 #include "roi.hpp"
 
 extern std::vector<std::string> fa_template_list;
-bool odf_data::read(gz_mat_read& mat_reader)
+bool odf_data::read(gz_mat_read& mat_reader_)
+{
+    mat_reader = nullptr;
+    odf_loaded = false;
+    odf_ready = false;
+    if((!mat_reader_.has("odfs") && !mat_reader_.has("odf0")) ||
+       !mat_reader_.has("dimension") || !mat_reader_.has("odf_vertices") || !mat_reader_.has("fa0"))
+        return false;
+    mat_reader = &mat_reader_;
+    return true;
+}
+bool odf_data::load(void)
 {
     unsigned int row,col;
+    auto& mat_reader = *(this->mat_reader);
     {
         if(mat_reader.read("odfs",row,col,odfs))
             odfs_size = row*col;
@@ -36,7 +48,7 @@ bool odf_data::read(gz_mat_read& mat_reader)
             }
         }
     }
-    if(!has_odfs())
+    if(odfs == nullptr && odf_blocks.empty())
         return false;
 
     // dimension
@@ -112,8 +124,30 @@ bool odf_data::read(gz_mat_read& mat_reader)
 }
 
 
-const float* odf_data::get_odf_data(unsigned int index) const
+bool odf_data::ensure_loaded(void)
+{
+    if(odf_ready.load(std::memory_order_acquire))
+        return odf_loaded;
+    if(!mat_reader)
+        return false;
+    std::lock_guard<std::mutex> lock(*mat_reader->read_mutex);
+    if(!odf_ready.load(std::memory_order_relaxed))
+    {
+        odf_loaded = load();
+        if(!odf_loaded)
+        {
+            odfs = nullptr;
+            odf_blocks.clear();
+        }
+        odf_ready.store(true,std::memory_order_release);
+    }
+    return odf_loaded;
+}
+
+const float* odf_data::get_odf_data(unsigned int index)
 {
+    if(!ensure_loaded())
+        return nullptr;
     if (odfs != nullptr)
     {
         if (index >= voxel_index_map.size() || voxel_index_map[index] == 0)
@@ -134,8 +168,7 @@ tipl::const_pointer_image<3,float> item::get_image(void)
 {
     if(!image_ready)
     {
-        static std::mutex mat_load;
-        std::lock_guard<std::mutex> lock(mat_load);
+        std::lock_guard<std::mutex> lock(*mat_reader->read_mutex);
         if(image_ready)
             return image_data;
         // delay read routine
@@ -445,14 +478,63 @@ void tracking_data::read(std::shared_ptr<fib_data> fib)
         threshold_name = fib->dir.get_threshold_name();
     if(!dt_fa.empty())
         dt_threshold_name = fib->dir.get_dt_threshold_name();
+    packed_index.clear();
+    packed_fib.clear();
+    if(use_packed_table && dt_fa.empty())
+        build_packed_table();
     if(fib->has_high_reso)
     {
         has_high_reso = true;
         high_reso_ratio = fib->vs[0]/fib->high_reso->vs[0];
         high_reso.reset(new tracking_data);
+        high_reso->use_packed_table = use_packed_table;
         high_reso->read(fib->high_reso);
     }
 }
+void tracking_data::set_fa(const std::vector<const float*>& new_fa)
+{
+    fa = new_fa;
+    if(!packed_index.empty())
+        build_packed_table();
+}
+void tracking_data::build_packed_table(void)
+{
+    packed_index.clear();
+    packed_fib.clear();
+    if(!fib_num)
+        return;
+    const size_t stride = size_t(fib_num) << 2;
+    std::vector<uint32_t> index(dim.size(),uint32_t(-1));
+    size_t count = 0;
+    for(size_t i = 0;i < dim.size();++i)
+    {
+        for(unsigned char j = 0;j < fib_num;++j)
+            if(fa[j][i] != 0.0f)
+            {
+                index[i] = uint32_t(count++);
+                break;
+            }
+    }
+    if(!count || count >= uint32_t(-1))
+        return;
+    std::vector<float> table(count*stride);
+    tipl::par_for(dim.size(),[&](size_t i)
+    {
+        if(index[i] == uint32_t(-1))
+            return;
+        float* record = &table[index[i]*stride];
+        for(unsigned char j = 0;j < fib_num;++j,record += 4)
+        {
+            const float* d = get_fib(i,j);
+            record[0] = fa[j][i];
+            record[1] = d[0];
+            record[2] = d[1];
+            record[3] = d[2];
+        }
+    });
+    packed_index.swap(index);
+    packed_fib.swap(table);
+}
 bool tracking_data::get_dir(size_t space_index,
                             const tipl::vector<3,float>& dir, // reference direction, should be unit vector
                             tipl::vector<3,float>& main_dir,
@@ -474,6 +556,118 @@ bool tracking_data::get_dir(size_t space_index,
     return true;
 }
 
+// same selection rule as tracking_data::get_dir, written as selects so that the lane loop vectorizes
+inline void select_fib8(unsigned char index,float threshold,const float* fa_value,const float* cos_value,
+                        float* max_value,float* sign,unsigned char* fib_order)
+{
+    for(unsigned int i = 0;i < 8;++i)
+    {
+        bool valid = !(fa_value[i] <= threshold);
+        bool take_reverse = valid && -cos_value[i] > max_value[i];
+        bool take_forward = valid && !take_reverse && cos_value[i] > max_value[i];
+        max_value[i] = take_reverse ? -cos_value[i] : (take_forward ? cos_value[i] : max_value[i]);
+        sign[i] = take_reverse ? -1.0f : (take_forward ? 1.0f : sign[i]);
+        fib_order[i] = (take_reverse || take_forward) ? index : fib_order[i];
+    }
+}
+unsigned char tracking_data::get_dir8(const size_t* space_index_,
+                            const tipl::vector<3,float>& ref_dir, // reference direction, should be unit vector
+                            tipl::vector<3,float>* main_dir,
+                            float threshold,
+                            float cull_cos_angle,
+                            float dt_threshold) const
+{
+    // the corners are processed as lanes: each fiber is gathered for all corners before the tests
+    size_t space_index[8];
+    float max_value[8],sign[8],fa_value[8],cos_value[8];
+    unsigned char fib_order[8],active[8];
+    for(unsigned int i = 0;i < 8;++i)
+    {
+        active[i] = space_index_[i] < dim.size() ? 1 : 0;
+        space_index[i] = active[i] ? space_index_[i] : 0;
+        max_value[i] = cull_cos_angle;
+        sign[i] = 1.0f;
+        fib_order[i] = 0;
+    }
+    if(!packed_index.empty())
+    {
+        const size_t stride = size_t(fib_num) << 2;
+        const float* record[8];
+        for(unsigned int i = 0;i < 8;++i)
+        {
+            uint32_t record_index = packed_index[space_index[i]];
+            active[i] = (active[i] && record_index != uint32_t(-1)) ? 1 : 0;
+            record[i] = active[i] ? &packed_fib[record_index*stride] : &packed_fib[0];
+        }
+        for (unsigned char index = 0;index < fib_num;++index)
+        {
+            for(unsigned int i = 0;i < 8;++i)
+            {
+                const float* r = record[i] + (index << 2);
+                fa_value[i] = r[0];
+                cos_value[i] = ref_dir[0]*r[1] + ref_dir[1]*r[2] + ref_dir[2]*r[3];
+            }
+            select_fib8(index,threshold,fa_value,cos_value,max_value,sign,fib_order);
+        }
+        unsigned char mask = 0;
+        for(unsigned int i = 0;i < 8;++i)
+        {
+            if(!active[i] || max_value[i] <= cull_cos_angle)
+                continue;
+            const float* r = record[i] + (fib_order[i] << 2);
+            main_dir[i][0] = sign[i]*r[1];
+            main_dir[i][1] = sign[i]*r[2];
+            main_dir[i][2] = sign[i]*r[3];
+            mask |= uint8_t(1 << i);
+        }
+        return mask;
+    }
+    for (unsigned char index = 0;index < fib_num;++index)
+    {
+        const float* fa_at = fa[index];
+        for(unsigned int i = 0;i < 8;++i)
+            fa_value[i] = fa_at[space_index[i]];
+        if(!dir.empty())
+        {
+            const float* dir_at = dir[index];
+            for(unsigned int i = 0;i < 8;++i)
+            {
+                const float* d = dir_at + space_index[i] + (space_index[i] << 1);
+                cos_value[i] = ref_dir[0]*d[0] + ref_dir[1]*d[1] + ref_dir[2]*d[2];
+            }
+        }
+        else
+        {
+            const short* findex_at = findex[index];
+            for(unsigned int i = 0;i < 8;++i)
+                cos_value[i] = ref_dir*odf_table[findex_at[space_index[i]]];
+        }
+        if(!dt_fa.empty()) // for differential tractography
+        {
+            const float* dt_fa_at = dt_fa[index];
+            for(unsigned int i = 0;i < 8;++i)
+                if(dt_fa_at[space_index[i]] <= dt_threshold)
+                    fa_value[i] = threshold;
+        }
+        select_fib8(index,threshold,fa_value,cos_value,max_value,sign,fib_order);
+    }
+    unsigned char mask = 0;
+    for(unsigned int i = 0;i < 8;++i)
+    {
+        if(!active[i] || max_value[i] <= cull_cos_angle)
+            continue;
+        main_dir[i] = get_fib(space_index[i],fib_order[i]);
+        if(sign[i] < 0.0f)
+        {
+            main_dir[i][0] = -main_dir[i][0];
+            main_dir[i][1] = -main_dir[i][1];
+            main_dir[i][2] = -main_dir[i][2];
+        }
+        mask |= uint8_t(1 << i);
+    }
+    return mask;
+}
+
 const float* tracking_data::get_fib(size_t space_index,unsigned char fib_order) const
 {
     if(!dir.empty())
@@ -528,7 +722,11 @@ void save_idx(const char* file_name,std::shared_ptr<gz_istream> in);
 bool read_fib_mat_with_idx(const char* file_name,gz_mat_read& mat_reader)
 {
     prepare_idx(file_name,mat_reader.in);
-    if(mat_reader.in->has_access_points())
+    // matrices are inflated at their first read when the reader can seek cheaply:
+    // uncompressed files, files with an index, or large files whose access points
+    // are sampled while the first pass skips over the matrices
+    if(!QString(file_name).endsWith(".gz") ||
+       mat_reader.in->has_access_points() || mat_reader.in->sample_access_point)
     {
         mat_reader.delay_read = true;
         mat_reader.in->buffer_all = false;
@@ -1500,11 +1698,57 @@ bool fib_data::load_track_atlas()
                 tract_data[i][j+2] = p[2];
             }
         });
+        track_atlas_idx.build(tract_data,dim);
         return true;
     }
     return true;
 }
 
+void tract_first_point_index::build(const std::vector<std::vector<float> >& tract_data,const tipl::shape<3>& dim,float cell_size_)
+{
+    cell_size = cell_size_;
+    grid = tipl::shape<3>(uint32_t(std::ceil(float(dim[0])/cell_size))+1,
+                          uint32_t(std::ceil(float(dim[1])/cell_size))+1,
+                          uint32_t(std::ceil(float(dim[2])/cell_size))+1);
+    std::vector<uint32_t> cell(tract_data.size(),uint32_t(-1));
+    cell_begin.clear();
+    cell_begin.resize(grid.size()+1);
+    for(size_t i = 0;i < tract_data.size();++i)
+        if(!tract_data[i].empty())
+        {
+            cell[i] = uint32_t(tipl::pixel_index<3>(cell_of(tract_data[i][0],0),
+                                                    cell_of(tract_data[i][1],1),
+                                                    cell_of(tract_data[i][2],2),grid).index());
+            ++cell_begin[cell[i]+1];
+        }
+    for(size_t i = 1;i < cell_begin.size();++i)
+        cell_begin[i] += cell_begin[i-1];
+    tract_index.resize(cell_begin.back());
+    auto pos = cell_begin;
+    for(size_t i = 0;i < tract_data.size();++i)
+        if(cell[i] != uint32_t(-1))
+            tract_index[pos[cell[i]]++] = uint32_t(i);
+}
+void tract_first_point_index::get_candidates(const float* pos,float tolerance,std::vector<uint32_t>& candidates) const
+{
+    candidates.clear();
+    size_t from[3],to[3];
+    for(unsigned int d = 0;d < 3;++d)
+    {
+        from[d] = cell_of(pos[d]-tolerance,d);
+        to[d] = cell_of(pos[d]+tolerance,d);
+    }
+    for(size_t z = from[2];z <= to[2];++z)
+        for(size_t y = from[1];y <= to[1];++y)
+        {
+            size_t base = (z*grid[1]+y)*grid[0];
+            candidates.insert(candidates.end(),
+                              tract_index.begin()+cell_begin[base+from[0]],
+                              tract_index.begin()+cell_begin[base+to[0]+1]);
+        }
+    std::sort(candidates.begin(),candidates.end());
+}
+
 //---------------------------------------------------------------------------
 template<typename T,typename U>
 unsigned int find_nearest_contain(const float* trk,unsigned int length,
@@ -1563,7 +1807,14 @@ unsigned int fib_data::find_nearest(const float* trk,unsigned int length,bool co
     if(contain)
         return find_nearest_contain(trk,length,track_atlas->get_tracts(),track_atlas->get_cluster_info());
     else
-        return ::find_nearest(trk,length,track_atlas->get_tracts(),track_atlas->get_cluster_info(),tolerance_dis_in_subject_voxels);
+    {
+        if(track_atlas_idx.empty())
+            return ::find_nearest(trk,length,track_atlas->get_tracts(),track_atlas->get_cluster_info(),tolerance_dis_in_subject_voxels);
+        // called per track from every tracking thread; keep the capacity between calls
+        thread_local std::vector<uint32_t> candidates;
+        track_atlas_idx.get_candidates(trk,tolerance_dis_in_subject_voxels,candidates);
+        return ::find_nearest(trk,length,track_atlas->get_tracts(),track_atlas->get_cluster_info(),tolerance_dis_in_subject_voxels,candidates);
+    }
 }
 //---------------------------------------------------------------------------
 
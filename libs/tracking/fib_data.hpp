@@ -3,12 +3,19 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <atomic>
 #include "TIPL/tipl.hpp"
 #include "gzip_interface.hpp"
 #include "connectometry_db.hpp"
 #include "atlas.hpp"
 
 struct odf_data{
+private:
+    gz_mat_read* mat_reader = nullptr;
+    std::atomic<bool> odf_ready{false};
+    bool odf_loaded = false; // published by odf_ready
+    bool load(void);
+    bool ensure_loaded(void);
 private:
     const float* odfs = nullptr;
     unsigned int odfs_size;
@@ -20,12 +27,13 @@ private:
     tipl::image<3,unsigned int> odf_block_map2;
     unsigned int half_odf_size;
 public:
+    // only checks the content, the ODFs are read at the first has_odfs or get_odf_data
     bool read(gz_mat_read& mat_reader);
-    bool has_odfs(void) const
+    bool has_odfs(void)
     {
-        return odfs != nullptr || !odf_blocks.empty();
+        return ensure_loaded();
     }
-    const float* get_odf_data(unsigned int index) const;
+    const float* get_odf_data(unsigned int index);
 };
 
 class fiber_directions
@@ -89,6 +97,15 @@ public:
     bool has_high_reso = false;
     float high_reso_ratio = 1.0f;
     std::shared_ptr<tracking_data> high_reso;
+public:
+    // optional voxel-major fiber table: each non-empty voxel stores {fa,x,y,z} for all fibers
+    // in one record (16 bytes per fiber). It is a snapshot of fa, so fa should be replaced
+    // through set_fa. use_packed_table is read by read().
+    bool use_packed_table = false;
+    std::vector<uint32_t> packed_index;
+    std::vector<float> packed_fib;
+    void build_packed_table(void);
+    void set_fa(const std::vector<const float*>& new_fa);
 private:
     const tracking_data& operator=(const tracking_data& rhs);
 public:
@@ -106,6 +123,13 @@ public:
                  float threshold,
                  float cull_cos_angle,
                  float dt_threshold) const;
+    // get_dir for the 8 corners of a trilinear interpolation at once, returns a bit mask of the corners with a direction
+    unsigned char get_dir8(const size_t* space_index,
+                 const tipl::vector<3,float>& dir, // reference direction, should be unit vector
+                 tipl::vector<3,float>* main_dir,
+                 float threshold,
+                 float cull_cos_angle,
+                 float dt_threshold) const;
     const float* get_fib(size_t space_index,unsigned char fib_order) const;
     float cos_angle(const tipl::vector<3>& cur_dir,size_t space_index,unsigned char fib_order) const;
     bool is_white_matter(const tipl::vector<3,float>& pos,float t) const;
@@ -171,6 +195,23 @@ public:
 
 };
 
+// spatial hash of streamlines keyed by their first point
+class tract_first_point_index{
+    float cell_size = 8.0f;
+    tipl::shape<3> grid;
+    std::vector<uint32_t> cell_begin;
+    std::vector<uint32_t> tract_index;
+    size_t cell_of(float v,unsigned int d) const
+    {
+        return size_t(std::min<float>(float(grid[d]-1),std::max<float>(0.0f,std::floor(v/cell_size))));
+    }
+public:
+    bool empty(void) const{return cell_begin.empty();}
+    void build(const std::vector<std::vector<float> >& tract_data,const tipl::shape<3>& dim,float cell_size_ = 8.0f);
+    // streamlines, in ascending order, whose first point is within tolerance along each axis
+    void get_candidates(const float* pos,float tolerance,std::vector<uint32_t>& candidates) const;
+};
+
 class TractModel;
 class fib_data
 {
@@ -218,6 +259,7 @@ public:
     std::string t1w_template_file_name,wm_template_file_name,mask_template_file_name;
 public:
     std::shared_ptr<TractModel> track_atlas;
+    tract_first_point_index track_atlas_idx;
     std::string tractography_atlas_file_name;
     std::vector<std::string> tractography_name_list;
     bool recognize(std::shared_ptr<TractModel>& trk,std::vector<unsigned int>& result,float tolerance);
@@ -280,8 +322,8 @@ public:
     bool load_from_mat(void);
     bool save_mapping(const std::string& index_name,const std::string& file_name);
 public:
-    bool has_odfs(void) const{return odf.has_odfs();}
-    const float* get_odf_data(unsigned int index) const{return odf.get_odf_data(index);}
+    bool has_odfs(void){return odf.has_odfs();}
+    const float* get_odf_data(unsigned int index){return odf.get_odf_data(index);}
 public:
     size_t get_name_index(const std::string& index_name) const;
     void get_index_list(std::vector<std::string>& index_list) const;
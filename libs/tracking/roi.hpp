@@ -78,11 +78,13 @@ public:
     }
 };
 
-template<typename T,typename U>
+// candidate(c), c < candidate_count: ascending indices of the atlas tracts to test
+template<typename T,typename U,typename candidate_type>
 __DEVICE_HOST__ unsigned int find_nearest(const float* trk,unsigned int length,
                           const T& tract_data,// = track_atlas->get_tracts();
                           const U& tract_cluster,// = track_atlas->get_cluster_info();
-                          float tolerance_dis_in_subject_voxels)
+                          float tolerance_dis_in_subject_voxels,
+                          size_t candidate_count,candidate_type&& candidate)
 {
     struct norm1_imp{
         inline float operator()(const float* v1,const float* v2)
@@ -108,8 +110,9 @@ __DEVICE_HOST__ unsigned int find_nearest(const float* trk,unsigned int length,
     float best_distance = tolerance_dis_in_subject_voxels;
     size_t best_index = tract_data.size();
     {
-        for(size_t i = 0;i < tract_data.size();++i)
+        for(size_t c = 0;c < candidate_count;++c)
         {
+            size_t i = candidate(c);
             if(min_min(best_distance,&tract_data[i][0],trk) >= best_distance ||
                 min_min(best_distance,&tract_data[i][tract_data[i].size()-3],trk+length-3) >= best_distance ||
                 min_min(best_distance,&tract_data[i][tract_data[i].size()/3/2*3],trk+(length/3/2*3)) >= best_distance)
@@ -160,6 +163,28 @@ __DEVICE_HOST__ unsigned int find_nearest(const float* trk,unsigned int length,
         return 9999;
     return tract_cluster[best_index];
 }
+// candidates: ascending indices of the atlas tracts that may be within tolerance (see tract_first_point_index),
+//             the other tracts fail the first-point test and are skipped without changing the result
+template<typename T,typename U>
+__DEVICE_HOST__ unsigned int find_nearest(const float* trk,unsigned int length,
+                          const T& tract_data,// = track_atlas->get_tracts();
+                          const U& tract_cluster,// = track_atlas->get_cluster_info();
+                          float tolerance_dis_in_subject_voxels,
+                          const std::vector<uint32_t>& candidates)
+{
+    return find_nearest(trk,length,tract_data,tract_cluster,tolerance_dis_in_subject_voxels,
+                        candidates.size(),[&](size_t c){return size_t(candidates[c]);});
+}
+// scans all atlas tracts
+template<typename T,typename U>
+__DEVICE_HOST__ unsigned int find_nearest(const float* trk,unsigned int length,
+                          const T& tract_data,// = track_atlas->get_tracts();
+                          const U& tract_cluster,// = track_atlas->get_cluster_info();
+                          float tolerance_dis_in_subject_voxels)
+{
+    return find_nearest(trk,length,tract_data,tract_cluster,tolerance_dis_in_subject_voxels,
+                        tract_data.size(),[](size_t c){return c;});
+}
 
 class RoiMgr {
 public:
@@ -175,6 +200,7 @@ public:
 public:
     float tolerance_dis_in_subject_voxels = 0.0f;
     unsigned int track_id = 0;
+    std::vector<float> atlas_end_points; // first and last points of the target atlas tracts
 public:
     RoiMgr(std::shared_ptr<fib_data> handle_):handle(handle_){}
 public:
@@ -223,15 +249,25 @@ public:
         }
         return false;
     }
+    // an accepted track must have an end within tolerance of an end of a target atlas tract (see find_nearest)
+    bool near_atlas_end_point(const float* point) const
+    {
+        if(tolerance_dis_in_subject_voxels == 0.0f)
+            return true;
+        for(size_t i = 0;i < atlas_end_points.size();i += 3)
+            if(std::fabs(atlas_end_points[i]-point[0])+
+               std::fabs(atlas_end_points[i+1]-point[1])+
+               std::fabs(atlas_end_points[i+2]-point[2]) < tolerance_dis_in_subject_voxels)
+                return true;
+        return false;
+    }
     bool have_include(const float* track,unsigned int buffer_size) const
     {
         for(unsigned int index = 0; index < inclusive.size(); ++index)
             if(!inclusive[index]->included(track,buffer_size))
                 return false;
         if(tolerance_dis_in_subject_voxels != 0.0f)
-            return find_nearest(track,buffer_size,
-                                handle->track_atlas->get_tracts(),handle->track_atlas->get_cluster_info(),
-                                tolerance_dis_in_subject_voxels) == track_id;
+            return handle->find_nearest(track,buffer_size,false,tolerance_dis_in_subject_voxels) == track_id;
         return true;
     }
     bool setAtlas(unsigned int track_id_,float tolerance_dis_in_icbm152_mm)
@@ -253,6 +289,17 @@ public:
                     (tolerance_dis_in_subject_voxels = tolerance_dis_in_icbm_voxels/float((s2t[0]-s2t[1]).length())) << " voxels" << std::endl;
         }
         track_id = track_id_;
+        {
+            const auto& tract_data = handle->track_atlas->get_tracts();
+            const auto& cluster = handle->track_atlas->get_cluster_info();
+            atlas_end_points.clear();
+            for(size_t i = 0;i < tract_data.size();++i)
+                if(cluster[i] == track_id && tract_data[i].size() >= 3)
+                {
+                    atlas_end_points.insert(atlas_end_points.end(),tract_data[i].begin(),tract_data[i].begin()+3);
+                    atlas_end_points.insert(atlas_end_points.end(),tract_data[i].end()-3,tract_data[i].end());
+                }
+        }
         report += " The anatomy prior of a tractography atlas (Yeh et al., Neuroimage 178, 57-68, 2018) was used to map ";
         report += handle->tractography_name_list[size_t(track_id)];
         report += "  with a distance tolerance of ";
@@ -20,7 +20,7 @@ struct TrackingParam
     float min_length = 30.0f;
     float max_length = 300.0f;
     unsigned int termination_count = 100000;
-    unsigned int max_seed_count = 0;
+    unsigned int max_seed_count = 0; // total seeds drawn by all threads together (0: no limit)
     unsigned char stop_by_tract = 1;
     unsigned char reserved0 = 0; // center_seed DEPRECATED
     unsigned char check_ending = 0;
@@ -137,6 +137,55 @@ struct TrackingParam
 };
 
 
+// Philox4x32-10 counter-based generator (Salmon et al., SC'11).
+// Each seed owns an independent stream keyed by (global seed, seed ordinal),
+// so tracking threads can draw random parameters without sharing any state.
+struct seed_rng{
+public:
+    using result_type = uint32_t;
+    static constexpr result_type min(void){return 0;}
+    static constexpr result_type max(void){return 0xFFFFFFFF;}
+private:
+    uint32_t key[2];
+    uint32_t counter[4];
+    uint32_t result[4];
+    unsigned int result_pos = 4;
+    void generate(void)
+    {
+        uint32_t c[4] = {counter[0],counter[1],counter[2],counter[3]};
+        uint32_t k[2] = {key[0],key[1]};
+        for(int round = 0;round < 10;++round)
+        {
+            uint64_t p0 = uint64_t(0xD2511F53)*c[0];
+            uint64_t p1 = uint64_t(0xCD9E8D57)*c[2];
+            c[0] = uint32_t(p1 >> 32)^c[1]^k[0];
+            c[1] = uint32_t(p1);
+            c[2] = uint32_t(p0 >> 32)^c[3]^k[1];
+            c[3] = uint32_t(p0);
+            k[0] += 0x9E3779B9;
+            k[1] += 0xBB67AE85;
+        }
+        std::copy(c,c+4,result);
+        result_pos = 0;
+        if(++counter[0] == 0)
+            ++counter[1];
+    }
+public:
+    seed_rng(uint32_t global_seed,uint64_t seed_ordinal):
+        key{global_seed,0},counter{0,0,uint32_t(seed_ordinal),uint32_t(seed_ordinal >> 32)}{}
+    result_type operator()(void)
+    {
+        if(result_pos == 4)
+            generate();
+        return result[result_pos++];
+    }
+    // uniform in [from,to) using the top 24 bits
+    float uniform(float from,float to)
+    {
+        return from + (to-from)*float((*this)() >> 8)*(1.0f/16777216.0f);
+    }
+};
+
 class TrackingMethod{
 public:// Parameters
     tipl::vector<3,float> position;
@@ -174,16 +223,19 @@ private:
         tipl::interpolator::linear<3> tri_interpo;
         if (!tri_interpo.get_location(fib->dim,position))
             return false;
-        tipl::vector<3,float> new_dir,main_dir;
+        size_t odf_space_index[8];
+        for (unsigned int index = 0;index < 8;++index)
+            odf_space_index[index] = size_t(tri_interpo.dindex[index]);
+        tipl::vector<3,float> new_dir,main_dir[8];
+        unsigned char has_dir = fib->get_dir8(odf_space_index,ref_dir,main_dir,current_fa_threshold,current_tracking_angle,current_dt_threshold);
         float total_weighting = 0.0f;
         for (unsigned int index = 0;index < 8;++index)
         {
-            size_t odf_space_index = tri_interpo.dindex[index];
-            if (!fib->get_dir(odf_space_index,ref_dir,main_dir,current_fa_threshold,current_tracking_angle,current_dt_threshold))
+            if (!(has_dir & (1 << index)))
                 continue;
             float w = tri_interpo.ratio[index];
-            main_dir *= w;
-            new_dir += main_dir;
+            main_dir[index] *= w;
+            new_dir += main_dir[index];
             total_weighting += w;
         }
         if (total_weighting < 0.5f)
@@ -268,6 +320,13 @@ public:
                 break;
 		}
 
+        // the last forward point is an end of the final track, so a track
+        // that cannot match the atlas is rejected before the backward pass
+        if constexpr(!std::is_same<tracking_algo,VoxelTracking>::value) // voxel tracking smooths the ends afterward
+        {
+            if(get_buffer_size() && !roi_mgr->near_atlas_end_point(&track_buffer[buffer_back_pos-3]))
+                return false;
+        }
         end_point1 = position;
         position = seed_pos;
         dir = -begin_dir;
@@ -294,9 +353,10 @@ public:
 
 
 	}
+        template<typename rng_type>
         bool init(unsigned char initial_direction,
                   const tipl::vector<3,float>& position_,
-                  std::mt19937& seed)
+                  rng_type& seed)
         {
             position = position_;
             if (!trk->dim.is_valid(position))
@@ -36,47 +36,57 @@ void ThreadData::run_thread(unsigned int thread_id)
         method->current_min_steps3 = 3*uint32_t(std::round(param.min_length/param.step_size));
     }
     float white_matter_t = param.threshold*1.2f;
+    uint64_t seed_ordinal = 0,seed_batch_end = 0,batch = 0;
+    bool in_batch = false;
+    const bool stop_by_tract = param.stop_by_tract == 1;
+    std::vector<std::vector<float> > tracts;
     if(!roi_mgr->seeds.empty())
     try{
         while(!joinning &&
-              !(param.stop_by_tract == 1 && tract_count[thread_id] >= end_count[thread_id]) &&
-              !(param.stop_by_tract == 0 && seed_count[thread_id] >= end_count[thread_id]) &&
-              !(param.max_seed_count > 0 && seed_count[thread_id] >= param.max_seed_count))
+              !(stop_by_tract && tract_pool >= param.termination_count))
         {
+            if(seed_ordinal == seed_batch_end)
+            {
+                if(in_batch)
+                    finish_batch(batch,tracts,thread_id);
+                in_batch = false;
+                seed_ordinal = seed_pool.fetch_add(seed_batch);
+                if(seed_ordinal >= seed_limit)
+                    break;
+                seed_batch_end = std::min<uint64_t>(seed_ordinal+seed_batch,seed_limit);
+                batch = seed_ordinal/seed_batch;
+                in_batch = true;
+            }
+            // the random stream depends only on the seed ordinal, not on which thread claimed it
+            seed_rng seed(random_seed,seed_ordinal++);
             ++seed_count[thread_id];
-            tipl::vector<3,float> pos;
-            uint32_t seed_id;
+            if(param.threshold == 0.0f)
             {
-                // this ensure consistency
-                std::lock_guard<std::mutex> lock(lock_seed_function);
-                if(param.threshold == 0.0f)
-                {
-                    float w = threshold_gen(seed);
-                    method->current_fa_threshold = w*fa_threshold1 + (1.0f-w)*fa_threshold2;
-                    white_matter_t = method->current_fa_threshold*1.2f;
-                }
-                if(param.cull_cos_angle == 1.0f)
-                    method->current_tracking_angle = std::cos(angle_gen(seed));
-                if(param.smooth_fraction == 1.0f)
-                    method->current_tracking_smoothing = smoothing_gen(seed);
-                if(param.step_size == 0.0f)
-                {
-                    float step_size_in_voxel = step_gen(seed);
-                    float step_size_in_mm = step_size_in_voxel*method->trk->vs[0];
-                    method->current_step_size_in_voxel[0] = step_size_in_voxel;
-                    method->current_step_size_in_voxel[1] = step_size_in_voxel;
-                    method->current_step_size_in_voxel[2] = step_size_in_voxel;
-                    method->current_max_steps3 = 3*uint32_t(std::round(param.max_length/step_size_in_mm));
-                    method->current_min_steps3 = 3*uint32_t(std::round(param.min_length/step_size_in_mm));
-                }
-
-                seed_id = std::min<uint32_t>(uint32_t(roi_mgr->seeds.size()-1),uint32_t(rand_gen(seed)*float(roi_mgr->seeds.size())));
-                pos = roi_mgr->seeds[seed_id];
-                pos[0] += subvoxel_gen(seed);
-                pos[1] += subvoxel_gen(seed);
-                pos[2] += subvoxel_gen(seed);
+                float w = seed.uniform(0.0f,1.0f);
+                method->current_fa_threshold = w*fa_threshold1 + (1.0f-w)*fa_threshold2;
+                white_matter_t = method->current_fa_threshold*1.2f;
+            }
+            if(param.cull_cos_angle == 1.0f)
+                method->current_tracking_angle = std::cos(seed.uniform(float(15.0*M_PI/180.0),float(90.0*M_PI/180.0)));
+            if(param.smooth_fraction == 1.0f)
+                method->current_tracking_smoothing = seed.uniform(0.0f,0.95f);
+            if(param.step_size == 0.0f)
+            {
+                float step_size_in_voxel = seed.uniform(0.5f,1.5f);
+                float step_size_in_mm = step_size_in_voxel*method->trk->vs[0];
+                method->current_step_size_in_voxel[0] = step_size_in_voxel;
+                method->current_step_size_in_voxel[1] = step_size_in_voxel;
+                method->current_step_size_in_voxel[2] = step_size_in_voxel;
+                method->current_max_steps3 = 3*uint32_t(std::round(param.max_length/step_size_in_mm));
+                method->current_min_steps3 = 3*uint32_t(std::round(param.min_length/step_size_in_mm));
             }
 
+            uint32_t seed_id = std::min<uint32_t>(uint32_t(roi_mgr->seeds.size()-1),uint32_t(seed.uniform(0.0f,1.0f)*float(roi_mgr->seeds.size())));
+            tipl::vector<3,float> pos(roi_mgr->seeds[seed_id]);
+            pos[0] += seed.uniform(-0.5f,0.5f);
+            pos[1] += seed.uniform(-0.5f,0.5f);
+            pos[2] += seed.uniform(-0.5f,0.5f);
+
             if(roi_mgr->seeds_r[seed_id] != 1.0f)
                 pos /= roi_mgr->seeds_r[seed_id];
             if(!method->init(param.initial_direction,pos,seed))
@@ -109,35 +119,76 @@ void ThreadData::run_thread(unsigned int thread_id)
                 }
             }
 
-            ++tract_count[thread_id];
-            if(buffer_switch)
-                track_buffer_front[thread_id].push_back(std::vector<float>(result,end));
-            else
-                track_buffer_back[thread_id].push_back(std::vector<float>(result,end));
+            tracts.push_back(std::vector<float>(result,end));
         }
     }
     catch(...)
     {
 
     }
-    running[thread_id] = 0;
+    // a batch cut short here lies beyond the accepted ordinals unless tracking was aborted
+    if(in_batch)
+        finish_batch(batch,tracts,thread_id);
+    {
+        std::lock_guard<std::mutex> lock(buffer_lock);
+        running[thread_id] = 0;
+    }
+    buffer_ready.notify_all();
+}
+
+void ThreadData::finish_batch(uint64_t batch,std::vector<std::vector<float> >& tracts_in_batch,unsigned int thread_id)
+{
+    {
+        std::lock_guard<std::mutex> lock(buffer_lock);
+        pending_batch[batch] = std::make_pair(thread_id,std::move(tracts_in_batch));
+        // release the completed prefix of batches in seed-ordinal order. When stopping
+        // by tract count, the batch that reaches termination_count is cut at the quota
+        // and later batches are dropped
+        for(auto iter = pending_batch.find(next_batch);iter != pending_batch.end();
+            iter = pending_batch.find(++next_batch))
+        {
+            auto& tracts = iter->second.second;
+            if(param.stop_by_tract == 1 && tract_pool >= param.termination_count)
+                tracts.clear();
+            if(!tracts.empty())
+            {
+                if(param.stop_by_tract == 1 && tracts.size() > param.termination_count-tract_pool)
+                    tracts.resize(param.termination_count-tract_pool);
+                tract_pool += uint32_t(tracts.size());
+                tract_count[iter->second.first] += uint32_t(tracts.size());
+                for(auto& tract : tracts)
+                    track_buffer.push_back(std::move(tract));
+            }
+            pending_batch.erase(iter);
+        }
+    }
+    tracts_in_batch.clear();
+    buffer_ready.notify_all();
+}
+
+bool ThreadData::wait_for_tracts(size_t count,std::chrono::milliseconds max_wait)
+{
+    std::unique_lock<std::mutex> lock(buffer_lock);
+    return buffer_ready.wait_for(lock,max_wait,[&]()
+    {
+        return track_buffer.size() >= count ||
+               std::find(running.begin(),running.end(),1) == running.end();
+    });
 }
 
 bool ThreadData::fetchTracks(TractModel* handle)
 {
-    bool has_track = false;
     if(handle->parameter_id.empty())
         handle->parameter_id = param.get_code();
-    auto& buffer_at_rest = buffer_switch ? track_buffer_back : track_buffer_front;
-    for(auto& tract_per_thread : buffer_at_rest)
-        if(!tract_per_thread.empty())
-        {
-            handle->add_tracts(tract_per_thread);
-            tract_per_thread.clear();
-            has_track = true;
-        }
-    buffer_switch = !buffer_switch;
-    return has_track;
+    std::vector<std::vector<float> > tracts;
+    {
+        std::lock_guard<std::mutex> lock(buffer_lock);
+        tracts.swap(track_buffer);
+    }
+    if(tracts.empty())
+        return false;
+    handle->add_tracts(tracts);
+    return true;
 }
 
 void ThreadData::apply_tip(TractModel* handle)
@@ -149,14 +200,14 @@ void ThreadData::apply_tip(TractModel* handle)
         max_length = std::max(max_length,float(handle->get_tracts()[i].size()));
     float t_index = float(handle->get_visible_track_count())*max_length/3.0f;
     if(t_index/float(roi_mgr->seeds.size()) > 20.0f || !trk->dt_threshold_name.empty())
-        for(size_t i = 0;i < param.tip_iteration;++i)
-            handle->trim();
+        handle->trim(param.tip_iteration);
 }
 
 void ThreadData::run(unsigned int thread_count,
                      bool wait)
 {
     std::shared_ptr<tracking_data> trk_(new tracking_data);
+    trk_->use_packed_table = use_packed_table;
     trk_->read(roi_mgr->handle);
     run(trk_,thread_count,wait);
 }
@@ -224,25 +275,31 @@ void ThreadData::run(std::shared_ptr<tracking_data> trk_,unsigned int thread_cou
     {
         seed_count.clear();
         tract_count.clear();
-        end_count.clear();
 
         seed_count.resize(thread_count);
         tract_count.resize(thread_count);
-        end_count.resize(thread_count);
-        running.resize(thread_count);
 
+        std::lock_guard<std::mutex> lock(buffer_lock);
+        running.resize(thread_count);
         std::fill(running.begin(),running.end(),1);
 
-        std::fill(end_count.begin(),end_count.end(),param.termination_count/thread_count);
-        end_count.back() = param.termination_count-end_count.front()*(thread_count-1);
+        seed_pool = 0;
+        tract_pool = 0;
+        pending_batch.clear();
+        next_batch = 0;
+        if(param.stop_by_tract == 0)
+            seed_limit = param.termination_count;
+        else
+            seed_limit = std::numeric_limits<uint64_t>::max()/2;
+        if(param.max_seed_count > 0)
+            seed_limit = std::min<uint64_t>(seed_limit,param.max_seed_count);
+        // small batches keep the load balanced near the end of the pool
+        seed_batch = std::max<uint32_t>(1,std::min<uint32_t>(64,param.termination_count/thread_count/16));
     }
 
 
     joinning = false;
-    seed = std::mt19937(0);
 
-    track_buffer_back.resize(thread_count);
-    track_buffer_front.resize(thread_count);
     for (unsigned int index = 0;index < thread_count-1;++index)
         threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
                 [&,index](){run_thread(index);})));
@@ -252,8 +309,6 @@ void ThreadData::run(std::shared_ptr<tracking_data> trk_,unsigned int thread_cou
         run_thread(thread_count-1);
         for(size_t i = 0;i < threads.size();++i)
             threads[i]->wait();
-        // make sure fetch tract get all data.
-        buffer_switch = !buffer_switch;
     }
     else
         threads.push_back(std::make_shared<std::future<void> >(std::async(std::launch::async,
@@ -4,6 +4,11 @@
 #include <ctime>
 #include <random>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <map>
 
 #include "roi.hpp"
 #include "tracking_method.hpp"
@@ -14,9 +19,6 @@
 #endif
 struct ThreadData
 {
-private:
-    std::mt19937 seed;
-    std::uniform_real_distribution<float> rand_gen,subvoxel_gen,angle_gen,smoothing_gen,step_gen,threshold_gen;
 public:
     std::shared_ptr<tracking_data> trk;
     std::shared_ptr<RoiMgr> roi_mgr;
@@ -24,24 +26,33 @@ public:
     std::ostringstream report;
     TrackingParam param;
     float fa_threshold1,fa_threshold2;// use only if fa_threshold=0
+    uint32_t random_seed = 0;// global key of the per-seed random streams
+    bool use_packed_table = false;// passed to the tracking_data built by run(thread_count,wait)
 
 public:
-    ThreadData(std::shared_ptr<fib_data> handle):seed(0),
-        rand_gen(0,1),subvoxel_gen(-0.5f,0.5f),angle_gen(float(15.0*M_PI/180.0),float(90.0*M_PI/180.0)),
-        smoothing_gen(0.0f,0.95f),step_gen(0.5f,1.5f),threshold_gen(0.0,1.0),
-        roi_mgr(new RoiMgr(handle)){}
+    ThreadData(std::shared_ptr<fib_data> handle):roi_mgr(new RoiMgr(handle)){}
     ~ThreadData(void)
     {
         end_thread();
     }
 public:
-    bool joinning = false;
+    std::atomic<bool> joinning{false};
     std::vector<std::shared_ptr<std::future<void> > > threads;
     std::vector<unsigned int> seed_count;
     std::vector<unsigned int> tract_count;
-    std::vector<unsigned int> end_count;
     std::vector<unsigned char> running;
-    std::mutex lock_seed_function;
+public:
+    // shared seed pool: threads claim batches of seed ordinals until the pool or the tract quota runs out
+    std::atomic<uint64_t> seed_pool{0};
+    std::atomic<uint32_t> tract_pool{0};
+    uint64_t seed_limit = 0;
+    uint32_t seed_batch = 1;
+    // finished batches are released in seed-ordinal order, keyed by batch and holding
+    // the producing thread, so that the output order does not depend on thread timing
+    // (guarded by buffer_lock)
+    std::map<uint64_t,std::pair<unsigned int,std::vector<std::vector<float> > > > pending_batch;
+    uint64_t next_batch = 0;
+    void finish_batch(uint64_t batch,std::vector<std::vector<float> >& tracts,unsigned int thread_id);
     unsigned int get_total_seed_count(void)const
     {
         return seed_count.empty() ? 0 : std::accumulate(seed_count.begin(),seed_count.end(),uint32_t(0));
@@ -52,12 +63,17 @@ public:
     }
     bool is_ended(void)
     {
+        std::lock_guard<std::mutex> lock(buffer_lock);
         return running.empty() ? true : std::find(running.begin(),running.end(),1) == running.end();
     }
 public:
-    bool buffer_switch = true;
-    std::vector<std::vector<std::vector<float> > > track_buffer_back,track_buffer_front;
+    // tracks handed off by the tracking threads, guarded by buffer_lock
+    std::vector<std::vector<float> > track_buffer;
+    std::mutex buffer_lock;
+    std::condition_variable buffer_ready;
     void end_thread(void);
+    // block until at least count tracts are ready, all threads ended, or max_wait passed
+    bool wait_for_tracts(size_t count,std::chrono::milliseconds max_wait);
 
 public:
     void run_thread(unsigned int thread_id);
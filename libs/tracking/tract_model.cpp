@@ -1,6 +1,7 @@
 //---------------------------------------------------------------------------
 #include <QString>
 #include <QFileInfo>
+#include <QFile>
 #include <QImage>
 #include <fstream>
 #include <sstream>
@@ -9,6 +10,7 @@
 #include <set>
 #include <map>
 #include <cmath>
+#include <atomic>
 #include "roi.hpp"
 #include "tract_model.hpp"
 #include "prog_interface_static_link.h"
@@ -50,6 +52,8 @@ void smoothed_tracks(const std::vector<float>& track,std::vector<float>& smoothe
 
 /* 1. spatial resolution of 1/32 voxel spacing.
  * 2. step size between (-127/32 to 128/32) voxels for x,y,z, direction
+ * 3. tracts are stored in blocks ("track", "track1", ...) of about 16 mb each.
+ *    "track_block" records the number of tracts in each block.
  */
 class TinyTrack{
 
@@ -62,7 +66,109 @@ class TinyTrack{
         int32_t z;
         } h;
     };
-
+    static void encode(const std::vector<float>& tract,std::vector<char>& out)
+    {
+        std::vector<int32_t> t32(tract.size());
+        // all coordinates multiply by 32 and convert to integer
+        for(size_t j = 0;j < t32.size();j++)
+            t32[j] = int(std::round(std::ldexp(tract[j],5)));
+        // Calculate coordinate displacement, skipping the first coordinate
+        for(size_t j = t32.size()-1;j >= 3;j--)
+            t32[j] -= t32[j-3];
+
+        // check if there is a leap, skipping the first coordinate
+        bool has_leap = false;
+        for(size_t j = 3;j < t32.size();j++)
+            if(t32[j] < -127 || t32[j] > 127)
+            {
+                has_leap = true;
+                break;
+            }
+        // if there is a leap, interpolate it
+        if(has_leap)
+        {
+            std::vector<int32_t> new_t32;
+            new_t32.reserve(t32.size());
+            for(size_t j = 0;j < t32.size();j += 3)
+            {
+                int32_t x = t32[j];
+                int32_t y = t32[j+1];
+                int32_t z = t32[j+2];
+                bool interpolated = false;
+                while(j && (x < -127 || x > 127 || y < -127 || y > 127 || z < -127 || z > 127))
+                {
+                    x /= 2;
+                    y /= 2;
+                    z /= 2;
+                    interpolated = true;
+                }
+                if(interpolated)
+                {
+                    t32[j] -= x;
+                    t32[j+1] -= y;
+                    t32[j+2] -= z;
+                    j -= 3;
+                }
+                new_t32.push_back(x);
+                new_t32.push_back(y);
+                new_t32.push_back(z);
+            }
+            new_t32.swap(t32);
+        }
+        out.resize(sizeof(tract_header)+t32.size()-3);
+        tract_header hr;
+        hr.h.count = uint32_t(t32.size());
+        hr.h.x = t32[0];
+        hr.h.y = t32[1];
+        hr.h.z = t32[2];
+        std::copy(hr.buf,hr.buf+16,out.begin());
+        for(size_t j = 3;j < t32.size();j++)
+            out[sizeof(tract_header)-3+j] = char(t32[j]);
+    }
+    static void decode(const std::vector<std::pair<const char*,size_t> >& blocks,
+                       std::vector<std::vector<float> >& tract_data)
+    {
+        // locate the tracts of each block in parallel
+        std::vector<std::vector<size_t> > block_pos(blocks.size());
+        tipl::par_for(blocks.size(),[&](size_t b)
+        {
+            for(size_t i = 0;i < blocks[b].second;)
+            {
+                block_pos[b].push_back(i);
+                i += *reinterpret_cast<const uint32_t*>(blocks[b].first+i);
+                i += sizeof(tract_header)-3;
+            }
+        });
+        std::vector<std::pair<size_t,size_t> > pos; // block and position of each tract
+        for(size_t b = 0;b < blocks.size();++b)
+            for(auto p : block_pos[b])
+                pos.push_back(std::make_pair(b,p));
+        size_t add_tract_index = tract_data.size();
+        tract_data.resize(add_tract_index+pos.size());
+        tipl::par_for(pos.size(),[&](size_t i)
+        {
+            auto& cur_tract = tract_data[i+add_tract_index];
+            const char* track_buf = blocks[pos[i].first].first;
+            size_t buf_size = blocks[pos[i].first].second;
+            tract_header hr;
+            std::copy(&track_buf[pos[i].second],&track_buf[pos[i].second]+16,hr.buf);
+            if(hr.h.count > buf_size)
+                return;
+            cur_tract.resize(hr.h.count);
+            cur_tract[0] = hr.h.x;
+            cur_tract[1] = hr.h.y;
+            cur_tract[2] = hr.h.z;
+            size_t shift = pos[i].second+sizeof(tract_header)-3;
+            for(size_t j = 3;j < cur_tract.size();++j)
+                cur_tract[j] = (cur_tract[j-3] + track_buf[shift+j]);
+            for(size_t j = 0;j < cur_tract.size();++j)
+                cur_tract[j] = std::ldexp(cur_tract[j],-5);
+        });
+    }
+    static std::string block_name(size_t block)
+    {
+        return block ? std::string("track")+std::to_string(block) : std::string("track");
+    }
     public:
     static bool save_to_file(const char* file_name,
                              tipl::shape<3> geo,
@@ -89,99 +195,39 @@ class TinyTrack{
         if(!cluster.empty())
             out.write("cluster",&cluster[0],cluster.size(),1);
 
-        std::vector<std::vector<int32_t> > track32(tract_data.size());
-        std::vector<size_t> buf_size(track32.size());
-        progress prog_("compressing trajectories");
-        size_t prog = 0;
-        tipl::par_for(track32.size(),[&](size_t i)
-        {
-            progress::at(prog++,tract_data.size());
-            auto& t32 = track32[i];
-            t32.resize(tract_data[i].size());
-            // all coordinates multiply by 32 and convert to integer
-            for(size_t j = 0;j < t32.size();j++)
-                t32[j] = int(std::round(std::ldexp(tract_data[i][j],5)));
-            // Calculate coordinate displacement, skipping the first coordinate
-            for(size_t j = t32.size()-1;j >= 3;j--)
-                t32[j] -= t32[j-3];
-
-            // check if there is a leap, skipping the first coordinate
-            bool has_leap = false;
-            for(size_t j = 3;j < t32.size();j++)
-                if(t32[j] < -127 || t32[j] > 127)
-                {
-                    has_leap = true;
-                    break;
-                }
-            // if there is a leap, interpolate it
-            if(has_leap)
-            {
-                std::vector<int32_t> new_t32;
-                new_t32.reserve(t32.size());
-                for(size_t j = 0;j < t32.size();j += 3)
-                {
-                    int32_t x = t32[j];
-                    int32_t y = t32[j+1];
-                    int32_t z = t32[j+2];
-                    bool interpolated = false;
-                    while(j && (x < -127 || x > 127 || y < -127 || y > 127 || z < -127 || z > 127))
-                    {
-                        x /= 2;
-                        y /= 2;
-                        z /= 2;
-                        interpolated = true;
-                    }
-                    if(interpolated)
-                    {
-                        t32[j] -= x;
-                        t32[j+1] -= y;
-                        t32[j+2] -= z;
-                        j -= 3;
-                    }
-                    new_t32.push_back(x);
-                    new_t32.push_back(y);
-                    new_t32.push_back(z);
-                }
-                new_t32.swap(t32);
-            }
-            buf_size[i] = sizeof(tract_header)+t32.size()-3;
-        });
+        // tracts are encoded block by block in parallel so that only one block
+        // is held in memory while the previous one is being written
+        const size_t block_limit = 16777216; // 16 mb of encoded tracts per block
+        std::vector<uint32_t> block_tract_count;
+        std::vector<std::vector<char> > encoded;
         progress::show((std::string("saving to ")+std::filesystem::path(file_name).filename().string()).c_str());
-        for(size_t block = 0,cur_track_block = 0;progress::at(cur_track_block,track32.size());++block)
+        for(size_t block = 0,cur_track_block = 0;progress::at(cur_track_block,tract_data.size());++block)
         {
-            // record write position for each track
-            size_t total_size = 0;
-            std::vector<size_t> pos;
-            for(size_t i = cur_track_block;i < track32.size();++i)
+            size_t block_end = cur_track_block;
+            for(size_t total_size = 0;block_end < tract_data.size() && total_size < block_limit;++block_end)
+                total_size += tract_data[block_end].size()+sizeof(tract_header)-3; // one byte per coordinate
+            encoded.resize(block_end-cur_track_block);
+            tipl::par_for(encoded.size(),[&](size_t i)
             {
-                pos.push_back(total_size);
-                total_size += buf_size[i];
-                if(total_size > 134217728) // 128 mb
-                    break;
-            }
+                encode(tract_data[cur_track_block+i],encoded[i]);
+            });
 
-            std::vector<char> out_buf(total_size);
-            tipl::par_for(pos.size(),[&](size_t i)
+            // record write position for each track
+            std::vector<size_t> pos(encoded.size()+1);
+            for(size_t i = 0;i < encoded.size();++i)
+                pos[i+1] = pos[i]+encoded[i].size();
+            std::vector<char> out_buf(pos.back());
+            tipl::par_for(encoded.size(),[&](size_t i)
             {
-                auto& t32 = track32[cur_track_block+i];
-                auto out = &out_buf[pos[i]];
-                tract_header hr;
-                hr.h.count = uint32_t(t32.size());
-                hr.h.x = t32[0];
-                hr.h.y = t32[1];
-                hr.h.z = t32[2];
-                std::copy(hr.buf,hr.buf+16,out);
-                out += sizeof(tract_header)-3;
-                for(size_t j = 3;j < t32.size();j++)
-                    out[j] = char(t32[j]);
+                std::copy(encoded[i].begin(),encoded[i].end(),out_buf.begin()+long(pos[i]));
             });
-
-            if(block == 0)
-                out.write("track",&out_buf[0],total_size,1);
-            else
-                out.write((std::string("track")+std::to_string(block)).c_str(),&out_buf[0],total_size,1);
-            cur_track_block += pos.size();
+            out.write(block_name(block).c_str(),&out_buf[0],out_buf.size(),1);
+            block_tract_count.push_back(uint32_t(encoded.size()));
+            cur_track_block = block_end;
         }
+        if(progress::aborted())
+            return false;
+        out.write("track_block",block_tract_count);
         return true;
     }
     static bool load_from_file(const char* file_name,
@@ -211,51 +257,24 @@ class TinyTrack{
             tract_cluster.resize(size_t(row)*size_t(col));
             std::copy(cluster,cluster+tract_cluster.size(),tract_cluster.begin());
         }
+        // files from older versions do not have the block table
+        const uint32_t* block_tract_count = nullptr;
+        if(in.read("track_block",row,col,block_tract_count))
+            tract_data.reserve(tract_data.size()+
+                               std::accumulate(block_tract_count,block_tract_count+size_t(row)*size_t(col),size_t(0)));
 
+        std::vector<std::pair<const char*,size_t> > blocks;
         for(unsigned int block = 0;1;block++)
         {
             const char* track_buf = nullptr;
-            if(block == 0)
-            {
-                if(!in.read("track",row,col,track_buf))
-                    return false;
-            }
-            else
-            {
-                auto name = std::string("track")+std::to_string(block);
-                if(!in.has(name.c_str()))
-                    break;
-                if(!in.read(name.c_str(),row,col,track_buf))
-                    return false;
-            }
-            size_t buf_size = size_t(row)*size_t(col);
-            std::vector<size_t> pos;
-            for(size_t i = 0;i < buf_size;)
-            {
-                pos.push_back(i);
-                i += *reinterpret_cast<const uint32_t*>(track_buf+i);
-                i += sizeof(tract_header)-3;
-            }
-            size_t add_tract_index = tract_data.size();
-            tract_data.resize(add_tract_index+pos.size());
-            tipl::par_for(pos.size(),[&](size_t i)
-            {
-                auto& cur_tract = tract_data[i+add_tract_index];
-                tract_header hr;
-                std::copy(&track_buf[pos[i]],&track_buf[pos[i]]+16,hr.buf);
-                if(hr.h.count > buf_size)
-                    return;
-                cur_tract.resize(hr.h.count);
-                cur_tract[0] = hr.h.x;
-                cur_tract[1] = hr.h.y;
-                cur_tract[2] = hr.h.z;
-                size_t shift = pos[i]+sizeof(tract_header)-3;
-                for(size_t j = 3;j < cur_tract.size();++j)
-                    cur_tract[j] = (cur_tract[j-3] + track_buf[shift+j]);
-                for(size_t j = 0;j < cur_tract.size();++j)
-                    cur_tract[j] = std::ldexp(cur_tract[j],-5);
-            });
+            auto name = block_name(block);
+            if(block && !in.has(name.c_str()))
+                break;
+            if(!in.read(name.c_str(),row,col,track_buf))
+                return false;
+            blocks.push_back(std::make_pair(track_buf,size_t(row)*size_t(col)));
         }
+        decode(blocks,tract_data);
 
         save_idx(file_name,in.in);
         return true;
@@ -458,6 +477,140 @@ struct Tck{
 
 
 
+bool mapped_tract_file::open(const char* file_name)
+{
+    close();
+    file = std::make_shared<QFile>(file_name);
+    if(!file->open(QIODevice::ReadOnly) || file->size() < qint64(sizeof(header_type)))
+        return false;
+    auto data = file->map(0,file->size());
+    if(!data)
+        return false;
+    std::copy(data,data+sizeof(header_type),reinterpret_cast<unsigned char*>(&header));
+    uint64_t file_size = uint64_t(file->size());
+    // count and positions come from the file, so compare each count against the
+    // room left after pos instead of multiplying them
+    auto within = [&](uint64_t pos,uint64_t count,uint64_t element_size)
+    {
+        return pos && pos <= file_size && count <= (file_size-pos)/element_size;
+    };
+    if(!std::equal(header.magic,header.magic+8,header_type().magic) ||
+       header.tract_count >= file_size/sizeof(uint64_t) ||
+       !within(header.offset_pos,header.tract_count+1,sizeof(uint64_t)) ||
+       !within(header.pool_pos,header.pool_size,sizeof(float)) ||
+       (header.cluster_pos && !within(header.cluster_pos,header.tract_count,sizeof(uint32_t))) ||
+       (header.color_pos && !within(header.color_pos,header.tract_count,sizeof(uint32_t))) ||
+       (header.text_pos && !within(header.text_pos,header.text_size,1)))
+    {
+        close();
+        return false;
+    }
+    offset = reinterpret_cast<const uint64_t*>(data+header.offset_pos);
+    pool = reinterpret_cast<const float*>(data+header.pool_pos);
+    if(offset[0] != 0 || offset[header.tract_count] != header.pool_size ||
+       !std::is_sorted(offset,offset+header.tract_count+1))
+    {
+        close();
+        return false;
+    }
+    if(header.cluster_pos)
+        cluster = reinterpret_cast<const uint32_t*>(data+header.cluster_pos);
+    if(header.color_pos)
+        color = reinterpret_cast<const uint32_t*>(data+header.color_pos);
+    if(header.text_pos)
+    {
+        // report and parameter id separated by a null character
+        std::string text(reinterpret_cast<const char*>(data+header.text_pos),header.text_size);
+        auto sep = text.find('\0');
+        report = text.substr(0,sep);
+        if(sep != std::string::npos)
+            parameter_id = text.substr(sep+1);
+    }
+    return true;
+}
+void mapped_tract_file::close(void)
+{
+    if(file.get())
+        file->close(); // also unmaps the file
+    file.reset();
+    offset = nullptr;
+    pool = nullptr;
+    cluster = nullptr;
+    color = nullptr;
+    header = header_type();
+}
+bool mapped_tract_file::save_to_file(const char* file_name,
+                                     const tipl::shape<3>& geo,const tipl::vector<3>& vs,const tipl::matrix<4,4>& trans_to_mni,
+                                     const std::vector<std::vector<float> >& tract_data,
+                                     const std::vector<unsigned int>& cluster,
+                                     const std::vector<unsigned int>& color,
+                                     const std::string& report,const std::string& parameter_id)
+{
+    std::ofstream out(file_name,std::ios::binary);
+    if(!out)
+        return false;
+    // sections are 8-byte aligned so that the mapped arrays can be read in place
+    auto align = [](uint64_t pos){return (pos+7) & ~uint64_t(7);};
+    std::vector<uint64_t> offset(tract_data.size()+1);
+    for(size_t i = 0;i < tract_data.size();++i)
+        offset[i+1] = offset[i]+tract_data[i].size();
+    std::string text = report + '\0' + parameter_id;
+
+    header_type h;
+    h.tract_count = tract_data.size();
+    h.pool_size = offset.back();
+    h.offset_pos = align(sizeof(header_type));
+    h.pool_pos = align(h.offset_pos+offset.size()*sizeof(uint64_t));
+    uint64_t end_pos = h.pool_pos+h.pool_size*sizeof(float);
+    if(cluster.size() == tract_data.size())
+    {
+        h.cluster_pos = align(end_pos);
+        end_pos = h.cluster_pos+h.tract_count*sizeof(uint32_t);
+    }
+    if(color.size() == tract_data.size())
+    {
+        h.color_pos = align(end_pos);
+        end_pos = h.color_pos+h.tract_count*sizeof(uint32_t);
+    }
+    h.text_pos = align(end_pos);
+    h.text_size = text.size();
+    for(int d = 0;d < 3;++d)
+    {
+        h.dim[d] = int32_t(geo[d]);
+        h.vs[d] = vs[d];
+    }
+    std::copy(&trans_to_mni[0],&trans_to_mni[0]+16,h.trans_to_mni);
+
+    auto pad_to = [&](uint64_t pos)
+    {
+        while(uint64_t(out.tellp()) < pos)
+            out.put(0);
+    };
+    out.write(reinterpret_cast<const char*>(&h),sizeof(h));
+    pad_to(h.offset_pos);
+    out.write(reinterpret_cast<const char*>(offset.data()),std::streamsize(offset.size()*sizeof(uint64_t)));
+    pad_to(h.pool_pos);
+    progress prog_("saving ",std::filesystem::path(file_name).filename().string().c_str());
+    for(size_t i = 0;progress::at(i,tract_data.size());++i)
+        out.write(reinterpret_cast<const char*>(tract_data[i].data()),std::streamsize(tract_data[i].size()*sizeof(float)));
+    if(progress::aborted())
+        return false;
+    if(h.cluster_pos)
+    {
+        pad_to(h.cluster_pos);
+        out.write(reinterpret_cast<const char*>(cluster.data()),std::streamsize(cluster.size()*sizeof(uint32_t)));
+    }
+    if(h.color_pos)
+    {
+        pad_to(h.color_pos);
+        out.write(reinterpret_cast<const char*>(color.data()),std::streamsize(color.size()*sizeof(uint32_t)));
+    }
+    pad_to(h.text_pos);
+    out.write(text.data(),std::streamsize(text.size()));
+    return bool(out);
+}
+
+
 bool tt2trk(const char* tt_file,const char* trk_file)
 {
     std::vector<std::vector<float> > tract_data;
@@ -688,6 +841,29 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
         if(color != old_color)
             color_changed = true;
     }
+    std::vector<unsigned int> loaded_tract_color;
+    if(QString(file_name_).endsWith(".ttx"))
+    {
+        mapped_tract_file in;
+        if(!in.open(file_name_))
+            return false;
+        geo = tipl::shape<3>(uint32_t(in.header.dim[0]),uint32_t(in.header.dim[1]),uint32_t(in.header.dim[2]));
+        vs = tipl::vector<3>(in.header.vs);
+        std::copy(in.header.trans_to_mni,in.header.trans_to_mni+16,&trans_to_mni[0]);
+        report = in.report;
+        parameter_id = in.parameter_id;
+        // TractModel owns its streamlines, so they are copied out of the mapping
+        loaded_tract_data.resize(in.size());
+        tipl::par_for(in.size(),[&](size_t i)
+        {
+            auto tract = in.get_tract(i);
+            loaded_tract_data[i].assign(tract.begin(),tract.end());
+        });
+        if(in.cluster)
+            loaded_tract_cluster.assign(in.cluster,in.cluster+in.size());
+        if(in.color)
+            loaded_tract_color.assign(in.color,in.color+in.size());
+    }
     if(QString(file_name_).endsWith("trk.gz") || QString(file_name_).endsWith("trk"))
     {
         TrackVis trk;
@@ -774,6 +950,11 @@ bool TractModel::load_from_file(const char* file_name_,bool append)
     tract_color.resize(tract_data.size());
     if(color)
         std::fill(tract_color.begin(),tract_color.end(),color);
+    if(loaded_tract_color.size() == tract_data.size())
+    {
+        loaded_tract_color.swap(tract_color);
+        color_changed = true;
+    }
     tract_tag.clear();
     tract_tag.resize(tract_data.size());
     deleted_tract_data.clear();
@@ -931,6 +1112,10 @@ bool TractModel::save_tracts_to_file(const char* file_name_)
         return TrackVis::save_to_file(file_name.c_str(),geo,vs,trans_to_mni,
                 tract_data,std::vector<std::vector<float> >(),parameter_id,tract_color.front());
     }
+    if(ext == std::string(".ttx"))
+        return mapped_tract_file::save_to_file(file_name.c_str(),geo,vs,trans_to_mni,tract_data,tract_cluster,
+                                               color_changed ? tract_color : std::vector<unsigned int>(),
+                                               report,parameter_id);
     if(ext == std::string(".tck"))
     {
         char header[200] = {0};
@@ -1686,90 +1871,73 @@ void TractModel::select_tracts(const std::vector<unsigned int>& tracts_to_select
     delete_tracts(not_selected);
 }
 //---------------------------------------------------------------------------
-void TractModel::delete_repeated(float d)
-{   
-    std::vector<std::vector<size_t> > x_reg;
-    std::vector<size_t> track_reg;
-    if(tract_data.size() > 50000)
-    {
-        x_reg.resize(geo.plane_size());
-        track_reg.resize(tract_data.size());
-        for(size_t i = 0; i < tract_data.size();++i)
-        {
-            int x = int(std::round(tract_data[i][0]));
-            int y = int(std::round(tract_data[i][1]));
-            if(x < 0)
-                x = 0;
-            if(y < 0)
-                y = 0;
-            if(x >= geo[0])
-                x = geo[0]-1;
-            if(y >= geo[1])
-                y = geo[1]-1;
-            x_reg[track_reg[i] = size_t(x + y*geo[0])].push_back(i);
-        }
+// true if any point of the track is within L1 distance d of p
+inline bool has_point_within(const float* p,const std::vector<float>& track,float d)
+{
+    const float* t = &track[0];
+    size_t size = track.size();
+    size_t n = 0;
+    // blocks of 8 points without branches so that the distance kernel vectorizes
+    for(;n+24 <= size;n += 24)
+    {
+        float block_min = std::numeric_limits<float>::max();
+        for(size_t k = 0;k < 24;k += 3)
+            block_min = std::min(block_min,std::fabs(p[0]-t[n+k])+std::fabs(p[1]-t[n+k+1])+std::fabs(p[2]-t[n+k+2]));
+        if(block_min <= d)
+            return true;
     }
+    for(;n < size;n += 3)
+        if(std::fabs(p[0]-t[n])+std::fabs(p[1]-t[n+1])+std::fabs(p[2]-t[n+2]) <= d)
+            return true;
+    return false;
+}
+inline bool is_repeated(const std::vector<float>& t1,const std::vector<float>& t2,float d)
+{
     auto norm1 = [](const float* v1,const float* v2){return std::fabs(v1[0]-v2[0])+std::fabs(v1[1]-v2[1])+std::fabs(v1[2]-v2[2]);};
-    struct min_min{
-        inline float operator()(float min_dis,const float* v1,const float* v2)
-        {
-            float d1 = std::fabs(v1[0]-v2[0]);
-            if(d1 > min_dis)
-                return min_dis;
-            d1 += std::fabs(v1[1]-v2[1]);
-            if(d1 > min_dis)
-                return min_dis;
-            d1 += std::fabs(v1[2]-v2[2]);
-            if(d1 > min_dis)
-                return min_dis;
-            return d1;
-        }
-    }min_min_fun;
-    std::vector<bool> repeated(tract_data.size());
-    tipl::par_for(tract_data.size(),[&](size_t i)
+    if(norm1(&t1[0],&t2[0]) >= d ||
+       norm1(&t1[t1.size()-3],&t2[t2.size()-3]) >= d)
+        return false;
+    for(size_t m = 0;m < t1.size();m += 3)
+        if(!has_point_within(&t1[m],t2,d))
+            return false;
+    for(size_t m = 0;m < t2.size();m += 3)
+        if(!has_point_within(&t2[m],t1,d))
+            return false;
+    return true;
+}
+void TractModel::delete_repeated(float d)
+{
+    if(tract_data.empty())
+        return;
+    // repeated tracks must have first points within d, so only tracks in nearby grid cells are compared
+    tract_first_point_index first_point;
+    first_point.build(tract_data,geo,std::max<float>(d,1.0f));
+    std::vector<std::vector<uint32_t> > repeated_with(tract_data.size());
+    tipl::par_for(tract_data.size(),[&](size_t j)
     {
-        if(repeated[i])
+        if(tract_data[j].empty())
             return;
-        size_t max_k = x_reg.empty() ? tract_data.size():x_reg[track_reg[i]].size();
-        for(size_t k = x_reg.empty() ? i+1:0;k < max_k;++k)
+        std::vector<uint32_t> candidates;
+        first_point.get_candidates(&tract_data[j][0],d,candidates);
+        for(auto i : candidates)
         {
-            size_t j = x_reg.empty() ? k :  x_reg[track_reg[i]][k];
-            if(j <= i || repeated[j] ||
-               min_min_fun(d,&tract_data[i][0],&tract_data[j][0]) >= d ||
-               min_min_fun(d,&tract_data[i][tract_data[i].size()-3],&tract_data[j][tract_data[j].size()-3]) >= d)
-                continue;
-            bool not_repeated = false;
-            for(size_t m = 0;m < tract_data[i].size();m += 3)
-            {
-                float min_dis = norm1(&tract_data[i][m],&tract_data[j][0]);
-                for(size_t n = 3;n < tract_data[j].size();n += 3)
-                    min_dis = min_min_fun(min_dis,&tract_data[i][m],&tract_data[j][n]);
-                if(min_dis > d)
-                {
-                    not_repeated = true;
-                    break;
-                }
-            }
-            if(!not_repeated)
-            for(size_t m = 0;m < tract_data[j].size();m += 3)
-            {
-                float min_dis = norm1(&tract_data[j][m],&tract_data[i][0]);
-                for(size_t n = 0;n < tract_data[i].size();n += 3)
-                    min_dis = min_min_fun(min_dis,&tract_data[j][m],&tract_data[i][n]);
-                if(min_dis > d)
-                {
-                    not_repeated = true;
-                    break;
-                }
-            }
-            if(!not_repeated)
-                repeated[j] = true;
+            if(i >= j)
+                break;
+            if(is_repeated(tract_data[i],tract_data[j],d))
+                repeated_with[j].push_back(i);
         }
     });
+    // visiting tracks in order, a track is deleted if it repeats an earlier track that was kept
+    std::vector<char> repeated(tract_data.size());
     std::vector<unsigned int> track_to_delete;
-    for(size_t i = 0;i < tract_data.size();++i)
-        if(repeated[i])
-            track_to_delete.push_back(uint32_t(i));
+    for(size_t j = 0;j < tract_data.size();++j)
+        for(auto i : repeated_with[j])
+            if(!repeated[i])
+            {
+                repeated[j] = 1;
+                track_to_delete.push_back(uint32_t(j));
+                break;
+            }
     delete_tracts(track_to_delete);
 }
 void TractModel::delete_branch(void)
@@ -2165,7 +2333,100 @@ void TractModel::cut_by_mask(const char*)
 //---------------------------------------------------------------------------
 
 
-bool TractModel::trim(void)
+inline unsigned int popcount64(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (unsigned int)((x*0x0101010101010101ULL) >> 56);
+}
+// number of tracks passing each voxel and the sum of their indices, which identifies
+// the remaining track once the count drops to one. Large volumes use a bitmap-ranked
+// sparse layout so that only the voxels touched by the tracks have counters.
+struct tip_occupancy{
+private:
+    tipl::shape<3> geo;
+    bool sparse;
+    std::vector<uint64_t> touched;
+    std::vector<size_t> rank; // empty until the sparse layout is built
+    std::vector<std::vector<size_t> > voxel_buf;
+public:
+    std::vector<std::atomic<uint32_t> > count;
+    std::vector<std::atomic<uint64_t> > owner_sum;
+public:
+    // sorted and unique voxels (or sparse slots) passed by a track, same neighborhood as the TIP label map
+    const std::vector<size_t>& voxels(const std::vector<float>& tract,size_t thread)
+    {
+        auto& buf = voxel_buf[thread];
+        buf.clear();
+        int width = geo.width();
+        int height = geo.height();
+        int depth = geo.depth();
+        int wh = width*height;
+        int shift[8] = {0,1,width,wh,1+width,1+wh,width+wh,1+width+wh};
+        for (size_t j = 0;j < tract.size();j += 3)
+        {
+            int x = int(tract[j]);
+            if (x <= 0 || x >= width)
+                continue;
+            int y = int(tract[j+1]);
+            if (y <= 0 || y >= height)
+                continue;
+            int z = int(tract[j+2]);
+            if (z <= 0 || z >= depth)
+                continue;
+            for(unsigned int i = 0;i < 8;++i)
+            {
+                size_t pixel_index = size_t(z*wh+y*width+x+shift[i]);
+                if (pixel_index < geo.size())
+                    buf.push_back(pixel_index);
+            }
+        }
+        std::sort(buf.begin(),buf.end());
+        buf.erase(std::unique(buf.begin(),buf.end()),buf.end());
+        if(!rank.empty())
+            for(auto& v : buf)
+                v = rank[v >> 6] + popcount64(touched[v >> 6] & ((uint64_t(1) << (v & 63))-1));
+        return buf;
+    }
+public:
+    tip_occupancy(const tipl::shape<3>& geo_,const std::vector<std::vector<float> >& tract_data):
+        geo(geo_),sparse(geo_.size() > 256*256*256),voxel_buf(std::thread::hardware_concurrency())
+    {
+        size_t size = geo.size();
+        if(sparse)
+        {
+            std::vector<std::atomic<uint64_t> > bitmap((geo.size()+63) >> 6);
+            tipl::par_for(tract_data.size(),[&](size_t i,size_t thread)
+            {
+                for(auto v : voxels(tract_data[i],thread))
+                    bitmap[v >> 6].fetch_or(uint64_t(1) << (v & 63));
+            });
+            touched.resize(bitmap.size());
+            std::vector<size_t> new_rank(bitmap.size());
+            size = 0;
+            for(size_t i = 0;i < bitmap.size();++i)
+            {
+                touched[i] = bitmap[i];
+                new_rank[i] = size;
+                size += popcount64(touched[i]);
+            }
+            rank.swap(new_rank);
+        }
+        std::vector<std::atomic<uint32_t> >(size).swap(count);
+        std::vector<std::atomic<uint64_t> >(size).swap(owner_sum);
+        tipl::par_for(tract_data.size(),[&](size_t i,size_t thread)
+        {
+            for(auto v : voxels(tract_data[i],thread))
+            {
+                ++count[v];
+                owner_sum[v] += i;
+            }
+        });
+    }
+};
+
+bool TractModel::trim(unsigned int iterations)
 {
     /*
     std::vector<char> continuous(tract_data.size());
@@ -2251,55 +2512,57 @@ bool TractModel::trim(void)
         delete_tracts(tracts_to_delete);
     */
 
-    tipl::image<3,unsigned int> label(geo);
-    int total_track_number = tract_data.size();
-    int no_fiber_label = total_track_number;
-    int have_multiple_fiber_label = total_track_number+1;
-
-    int width = label.width();
-    int height = label.height();
-    int depth = label.depth();
-    int wh = width*height;
-    std::fill(label.begin(),label.end(),no_fiber_label);
-    int shift[8] = {0,1,width,wh,1+width,1+wh,width+wh,1+width+wh};
-    tipl::par_for(total_track_number,[&](int index)
-    {
-        const float* ptr = &*tract_data[index].begin();
-        const float* end = ptr + tract_data[index].size();
-        for (;ptr < end;ptr += 3)
-        {
-            int x = *ptr;
-            if (x <= 0 || x >= width)
-                continue;
-            int y = *(ptr+1);
-            if (y <= 0 || y >= height)
-                continue;
-            int z = *(ptr+2);
-            if (z <= 0 || z >= depth)
-                continue;
-            for(unsigned int i = 0;i < 8;++i)
+    if(tract_data.empty() || !iterations)
+        return false;
+    tip_occupancy occupancy(geo,tract_data);
+    // first iteration: a track is pruned if it is the only track passing any voxel
+    std::vector<char> to_delete(tract_data.size());
+    tipl::par_for(tract_data.size(),[&](size_t i,size_t thread)
+    {
+        for(auto v : occupancy.voxels(tract_data[i],thread))
+            if(occupancy.count[v] == 1)
             {
-                unsigned int pixel_index = z*wh+y*width+x+shift[i];
-                if (pixel_index >= label.size())
-                    continue;
-                unsigned int cur_label = label[pixel_index];
-                if (cur_label == have_multiple_fiber_label || cur_label == index)
-                    continue;
-                if (cur_label == no_fiber_label)
-                    label[pixel_index] = index;
-                else
-                    label[pixel_index] = have_multiple_fiber_label;
+                to_delete[i] = 1;
+                return;
             }
-        }
     });
+    std::vector<unsigned int> tracts_to_delete;
+    for(unsigned int i = 0;i < to_delete.size();++i)
+        if(to_delete[i])
+            tracts_to_delete.push_back(i);
 
-    std::set<unsigned int> tracts_to_delete;
-    for (unsigned int index = 0;index < label.size();++index)
-        if (label[index] < total_track_number)
-            tracts_to_delete.insert(label[index]);
+    // later iterations: only voxels left with one track by the last pruning can prune more tracks
+    std::vector<unsigned int> pruned(tracts_to_delete);
+    for(unsigned int iter = 1;iter < iterations && !pruned.empty();++iter)
+    {
+        std::vector<std::vector<size_t> > changed(std::thread::hardware_concurrency());
+        tipl::par_for(pruned.size(),[&](size_t i,size_t thread)
+        {
+            for(auto v : occupancy.voxels(tract_data[pruned[i]],thread))
+            {
+                occupancy.owner_sum[v] -= pruned[i];
+                if(occupancy.count[v]-- == 2)
+                    changed[thread].push_back(v);
+            }
+        });
+        pruned.clear();
+        for(const auto& changed_per_thread : changed)
+            for(auto v : changed_per_thread)
+                if(occupancy.count[v] == 1)
+                {
+                    auto owner = uint32_t(occupancy.owner_sum[v]);
+                    if(!to_delete[owner])
+                    {
+                        to_delete[owner] = 1;
+                        pruned.push_back(owner);
+                    }
+                }
+        tracts_to_delete.insert(tracts_to_delete.end(),pruned.begin(),pruned.end());
+    }
     if(tracts_to_delete.empty())
         return false;
-    delete_tracts(std::vector<unsigned int>(tracts_to_delete.begin(),tracts_to_delete.end()));
+    std::sort(tracts_to_delete.begin(),tracts_to_delete.end());
+    delete_tracts(tracts_to_delete);
     return true;
 }
 //---------------------------------------------------------------------------
@@ -2390,13 +2653,51 @@ void TractModel::add_tracts(std::vector<std::vector<float> >& new_tract, unsigne
     saved = false;
 }
 //---------------------------------------------------------------------------
+inline size_t voxel_of(size_t index){return index;}
+template<class T>
+inline size_t voxel_of(const std::pair<size_t,T>& item){return item.first;}
+// Splats per-tract contributions into a volume without data races.
+// gen(i,items) lists the contributions of tract i sorted by voxel index.
+// The volume is split into one slab per thread so that each voxel is only
+// written by one thread and always in tract order, which keeps the result
+// independent of the thread count.
+template<class item_type,class gen_type,class add_type>
+void splat_tracts(size_t tract_count,size_t voxel_count,gen_type&& gen,add_type&& add)
+{
+    const size_t block_size = 4096;
+    const size_t slab_count = std::max<size_t>(1,std::thread::hardware_concurrency());
+    const size_t slab_size = voxel_count/slab_count+1;
+    std::vector<std::vector<item_type> > items(std::min(block_size,tract_count));
+    for(size_t from = 0;from < tract_count;from += block_size)
+    {
+        size_t size = std::min(block_size,tract_count-from);
+        tipl::par_for(size,[&](size_t k)
+        {
+            items[k].clear();
+            gen(from+k,items[k]);
+        });
+        tipl::par_for(slab_count,[&](size_t slab)
+        {
+            size_t slab_begin = slab*slab_size;
+            size_t slab_end = slab_begin+slab_size;
+            for(size_t k = 0;k < size;++k)
+            {
+                auto iter = std::lower_bound(items[k].begin(),items[k].end(),slab_begin,
+                                [](const item_type& lhs,size_t rhs){return voxel_of(lhs) < rhs;});
+                for(;iter != items[k].end() && voxel_of(*iter) < slab_end;++iter)
+                    add(*iter);
+            }
+        });
+    }
+}
+//---------------------------------------------------------------------------
 void TractModel::get_density_map(tipl::image<3,unsigned int>& mapping,
                                  const tipl::matrix<4,4>& transformation,bool endpoint)
 {
     tipl::shape<3> geo = mapping.shape();
-    tipl::par_for(tract_data.size(),[&](unsigned int i)
+    splat_tracts<size_t>(tract_data.size(),mapping.size(),
+                         [&](size_t i,std::vector<size_t>& point_set)
     {
-        std::set<size_t> point_set;
         for (unsigned int j = 0;j < tract_data[i].size();j+=3)
         {
             if(j && endpoint)
@@ -2406,11 +2707,14 @@ void TractModel::get_density_map(tipl::image<3,unsigned int>& mapping,
             pos.round();
             tipl::vector<3,int> ipos(pos);
             if (geo.is_valid(ipos))
-                point_set.insert(tipl::voxel2index(ipos.begin(),mapping.shape()));
+                point_set.push_back(tipl::voxel2index(ipos.begin(),mapping.shape()));
         }
-
-        for(auto pos : point_set)
-            ++mapping[pos];
+        // each tract counts a voxel only once
+        std::sort(point_set.begin(),point_set.end());
+        point_set.erase(std::unique(point_set.begin(),point_set.end()),point_set.end());
+    },[&](size_t pos)
+    {
+        ++mapping[pos];
     });
 }
 //---------------------------------------------------------------------------
@@ -2421,7 +2725,9 @@ void TractModel::get_density_map(
     tipl::shape<3> geo = mapping.shape();
     tipl::image<3> map_r(geo),map_g(geo),map_b(geo);
     std::cout << "aggregating tracts to voxels" << std::endl;
-    tipl::par_for (tract_data.size(),[&](unsigned int i)
+    using item_type = std::pair<size_t,tipl::vector<3,float> >;
+    splat_tracts<item_type>(tract_data.size(),mapping.size(),
+                            [&](size_t i,std::vector<item_type>& points)
     {
         const float* buf = &*tract_data[i].begin();
         for (unsigned int j = 3;j < tract_data[i].size();j+=3)
@@ -2437,11 +2743,16 @@ void TractModel::get_density_map(
             tipl::vector<3,int> ipos(pos);
             if (!geo.is_valid(ipos))
                 continue;
-            size_t ptr = tipl::voxel2index(ipos.begin(),mapping.shape());
-            map_r[ptr] += std::fabs(dir[0]);
-            map_g[ptr] += std::fabs(dir[1]);
-            map_b[ptr] += std::fabs(dir[2]);
+            points.push_back(std::make_pair(size_t(tipl::voxel2index(ipos.begin(),mapping.shape())),dir));
         }
+        // stable sort keeps the point order within a voxel
+        std::stable_sort(points.begin(),points.end(),
+                         [](const item_type& lhs,const item_type& rhs){return lhs.first < rhs.first;});
+    },[&](const item_type& point)
+    {
+        map_r[point.first] += std::fabs(point.second[0]);
+        map_g[point.first] += std::fabs(point.second[1]);
+        map_b[point.first] += std::fabs(point.second[2]);
     });
     std::cout << "generating rgb maps" << std::endl;
     float max_value = 0.0f;
@@ -2474,18 +2785,13 @@ bool TractModel::export_end_pdi(
     {
         std::vector<tipl::vector<3,short> > p1,p2;
         tract_models[index]->to_end_point_voxels(p1,p2,1.0f,end_distance);
-        tipl::par_for(p1.size(),[&](size_t j)
-        {
-            tipl::vector<3,short> p = p1[j];
+        // the increments are too cheap to share between threads without atomics
+        for(const auto& p : p1)
             if(dim.is_valid(p))
-                p1_map[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()]++;
-        });
-        tipl::par_for(p2.size(),[&](size_t j)
-        {
-            tipl::vector<3,short> p = p2[j];
+                ++p1_map[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()];
+        for(const auto& p : p2)
             if(dim.is_valid(p))
-                p2_map[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()]++;
-        });
+                ++p2_map[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()];
     }
     tipl::image<3> pdi1(p1_map),pdi2(p2_map);
     if(tract_models.size() > 1)
@@ -2512,12 +2818,9 @@ bool TractModel::export_pdi(const char* file_name,
     {
         std::vector<tipl::vector<3,short> > points;
         tract_models[index]->to_voxel(points,1.0f);
-        tipl::par_for(points.size(),[&](size_t j)
-        {
-            tipl::vector<3,short> p = points[j];
+        for(const auto& p : points)
             if(dim.is_valid(p))
-                accumulate_map[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()]++;
-        });
+                ++accumulate_map[tipl::pixel_index<3>(p[0],p[1],p[2],dim).index()];
     }
     tipl::image<3> pdi(accumulate_map);
     if(tract_models.size() > 1)
@@ -2548,6 +2851,207 @@ bool TractModel::export_tdi(const char* filename,
         return gz_nifti::save_to_file(filename,tdi,vs,tipl::matrix<4,4>(tract_models[0]->trans_to_mni*transformation),tract_models[0]->is_mni);
     }
 }
+// Walks a segment through the voxels of the target grid (3D DDA) and reports the
+// length of the segment inside each voxel. Coordinates are shifted by half a voxel
+// so that voxel k spans [k,k+1).
+template<class fun_type>
+void rasterize_segment(tipl::vector<3,float> from,tipl::vector<3,float> to,fun_type&& fun)
+{
+    tipl::vector<3,float> dir(to-from);
+    float length = float(dir.length());
+    int v[3],step[3];
+    float t_max[3],t_delta[3];
+    unsigned int steps = 0;
+    for(int d = 0;d < 3;++d)
+    {
+        v[d] = int(std::floor(from[d]));
+        int v_end = int(std::floor(to[d]));
+        steps += uint32_t(std::abs(v_end-v[d]));
+        step[d] = dir[d] > 0.0f ? 1 : -1;
+        if(dir[d] == 0.0f)
+        {
+            t_max[d] = t_delta[d] = std::numeric_limits<float>::max();
+            continue;
+        }
+        t_delta[d] = std::fabs(1.0f/dir[d]);
+        t_max[d] = (dir[d] > 0.0f ? float(v[d]+1)-from[d] : from[d]-float(v[d]))*t_delta[d];
+    }
+    float t = 0.0f;
+    for(unsigned int i = 0;i <= steps;++i)
+    {
+        int axis = (t_max[0] < t_max[1]) ? (t_max[0] < t_max[2] ? 0 : 2) : (t_max[1] < t_max[2] ? 1 : 2);
+        float t_next = (i == steps) ? 1.0f : std::min<float>(1.0f,t_max[axis]);
+        // exact edge or corner ties (and repeated points) step through voxels
+        // that the segment only touches
+        if((t_next-t)*length > 0.0f)
+            fun(v,(t_next-t)*length);
+        t = t_next;
+        v[axis] += step[axis];
+        t_max[axis] += t_delta[axis];
+    }
+}
+bool TractModel::export_segment_tdi(const char* filename,
+                                    const std::vector<std::shared_ptr<TractModel> >& tract_models,
+                                    const tipl::shape<3>& dim,
+                                    const tipl::vector<3,float>& vs,
+                                    const tipl::matrix<4,4>& transformation,
+                                    bool trilinear,bool length_weighted,size_t slab_voxel_count)
+{
+    if(tract_models.empty() ||
+       (!QFileInfo(filename).fileName().endsWith(".nii") &&
+        !QFileInfo(filename).fileName().endsWith(".nii.gz")))
+        return false;
+    // all tracts of all models are handled as one list
+    std::vector<size_t> tract_offset(1);
+    for(const auto& each : tract_models)
+        tract_offset.push_back(tract_offset.back()+each->tract_data.size());
+    auto get_tract = [&](size_t i)->const std::vector<float>&
+    {
+        size_t model = size_t(std::upper_bound(tract_offset.begin(),tract_offset.end(),i)-tract_offset.begin())-1;
+        return tract_models[model]->tract_data[i-tract_offset[model]];
+    };
+
+    // z-range of each tract in the target grid to skip tracts outside the current slab
+    std::vector<std::pair<float,float> > z_range(tract_offset.back());
+    tipl::par_for(z_range.size(),[&](size_t i)
+    {
+        const auto& tract = get_tract(i);
+        z_range[i] = std::make_pair(std::numeric_limits<float>::max(),std::numeric_limits<float>::lowest());
+        for(size_t j = 0;j < tract.size();j += 3)
+        {
+            tipl::vector<3,float> pos(&tract[j]);
+            pos.to(transformation);
+            z_range[i].first = std::min<float>(z_range[i].first,pos[2]);
+            z_range[i].second = std::max<float>(z_range[i].second,pos[2]);
+        }
+    });
+
+    tipl::matrix<4,4> trans(tract_models[0]->trans_to_mni*transformation);
+    size_t plane_size = dim.plane_size();
+    int slab_depth = int(std::max<size_t>(1,std::min<size_t>(dim[2],slab_voxel_count/plane_size)));
+    // a map that fits in one slab is saved by gz_nifti::save_to_file like export_tdi.
+    // a larger one is written slab by slab after a header set up the same way,
+    // so that the whole map never resides in memory
+    bool stream = slab_depth < int(dim[2]);
+    gz_ostream out;
+    if(stream)
+    {
+        gz_nifti nii;
+        nii.set_image_transformation(trans,tract_models[0]->is_mni);
+        nii.set_voxel_size(vs);
+        nii << tipl::image<3>(tipl::shape<3>(dim[0],dim[1],1));
+        nii.nif_header.dim[3] = short(dim[2]);
+        nii.nif_header.vox_offset = 352.0f; // header and extension flag, data follows
+        if(!out.open(filename))
+            return false;
+        int32_t extension = 0;
+        out.write(&nii.nif_header,sizeof(nii.nif_header));
+        out.write(&extension,sizeof(extension));
+    }
+
+    using item_type = std::pair<size_t,float>;
+    tipl::image<3> slab;
+    progress prog_("exporting TDI");
+    for(int z0 = 0;progress::at(uint32_t(z0),uint32_t(dim[2])) && z0 < int(dim[2]) && (!stream || out.good());z0 += slab_depth)
+    {
+        int z1 = std::min<int>(int(dim[2]),z0+slab_depth);
+        slab = tipl::image<3>(tipl::shape<3>(dim[0],dim[1],uint32_t(z1-z0)));
+        splat_tracts<item_type>(z_range.size(),slab.size(),[&](size_t i,std::vector<item_type>& items)
+        {
+            if(z_range[i].second+1.0f < float(z0)-0.5f || z_range[i].first-1.0f > float(z1)-0.5f)
+                return;
+            auto emit = [&](const int* v,float w)
+            {
+                if(v[0] < 0 || v[1] < 0 || v[2] < z0 || v[0] >= int(dim[0]) || v[1] >= int(dim[1]) || v[2] >= z1)
+                    return;
+                items.push_back(std::make_pair(size_t(v[0])+size_t(v[1])*dim[0]+size_t(v[2]-z0)*plane_size,w));
+            };
+            const auto& tract = get_tract(i);
+            for(size_t j = 3;j < tract.size();j += 3)
+            {
+                tipl::vector<3,float> from(&tract[j-3]),to(&tract[j]);
+                from.to(transformation);
+                to.to(transformation);
+                if(!trilinear)
+                {
+                    from += 0.5f;
+                    to += 0.5f;
+                    rasterize_segment(from,to,[&](const int* v,float length)
+                    {
+                        emit(v,length_weighted ? length : 1.0f);
+                    });
+                    continue;
+                }
+                // sample the segment at no more than half a voxel and spread each sample to its 8 neighbors
+                float length = float((to-from).length());
+                unsigned int n = std::max<unsigned int>(1,uint32_t(std::ceil(length*2.0f)));
+                for(unsigned int k = 0;k < n;++k)
+                {
+                    tipl::vector<3,float> pos(to-from);
+                    pos *= (float(k)+0.5f)/float(n);
+                    pos += from;
+                    int base[3];
+                    float frac[3];
+                    for(int d = 0;d < 3;++d)
+                    {
+                        base[d] = int(std::floor(pos[d]));
+                        frac[d] = pos[d]-float(base[d]);
+                    }
+                    for(int c = 0;c < 8;++c)
+                    {
+                        int v[3];
+                        float w = 1.0f;
+                        for(int d = 0;d < 3;++d)
+                        {
+                            bool upper = (c >> d) & 1;
+                            v[d] = base[d]+(upper ? 1:0);
+                            w *= upper ? frac[d] : 1.0f-frac[d];
+                        }
+                        if(w > 0.0f)
+                            emit(v,length_weighted ? w*length/float(n) : w);
+                    }
+                }
+            }
+            // a tract contributes its total length (length weighted) or at most one
+            // count to each voxel; trilinear weights are summed and then capped at 1
+            std::stable_sort(items.begin(),items.end(),[](const item_type& lhs,const item_type& rhs){return lhs.first < rhs.first;});
+            size_t last = 0;
+            for(size_t k = 1;k < items.size();++k)
+            {
+                if(items[k].first == items[last].first)
+                {
+                    if(length_weighted || trilinear)
+                        items[last].second += items[k].second;
+                    else
+                        items[last].second = std::max<float>(items[last].second,items[k].second);
+                }
+                else
+                    items[++last] = items[k];
+            }
+            if(!items.empty())
+                items.resize(last+1);
+            if(trilinear && !length_weighted)
+                for(auto& item : items)
+                    item.second = std::min<float>(item.second,1.0f);
+        },[&](const item_type& item)
+        {
+            slab[item.first] += item.second;
+        });
+        if(stream)
+            out.write(&*slab.begin(),slab.size()*sizeof(float));
+    }
+    if(!stream)
+        return !progress::aborted() && gz_nifti::save_to_file(filename,slab,vs,trans,tract_models[0]->is_mni);
+    bool complete = !progress::aborted() && out.good();
+    out.close();
+    if(!complete || !out.good())
+    {
+        // do not leave a truncated map behind
+        std::filesystem::remove(filename);
+        return false;
+    }
+    return true;
+}
 void TractModel::to_voxel(std::vector<tipl::vector<3,short> >& points,float ratio,int id)
 {
     float voxel_length_2 = 0.5f/ratio;
@@ -3185,7 +3689,7 @@ void TractModel::get_tracts_data(std::shared_ptr<fib_data> handle,unsigned int d
         mean = float(sum_data/double(total));
 }
 
-void TractModel::get_passing_list(const tipl::image<3,std::vector<short> >& region_map,
+void TractModel::get_passing_list(const region_set_map& region_map,
                                   unsigned int region_count,
                                   std::vector<std::vector<short> >& passing_list1,
                                   std::vector<std::vector<short> >& passing_list2) const
@@ -3208,9 +3712,8 @@ void TractModel::get_passing_list(const tipl::image<3,std::vector<short> >& regi
                                         std::round(tract_data[index][ptr+2]),geo);
             if(!geo.is_valid(pos))
                 continue;
-            unsigned int pos_index = uint32_t(pos.index());
-            for(unsigned int j = 0;j < region_map[pos_index].size();++j)
-                has_region[uint32_t(region_map[pos_index][j])] = 1;
+            for(auto iter = region_map.begin(pos.index()),end = region_map.end(pos.index());iter != end;++iter)
+                has_region[uint32_t(*iter)] = 1;
         }
         for(unsigned int i = 0;i < has_region.size();++i)
             if(has_region[i])
@@ -3221,7 +3724,7 @@ void TractModel::get_passing_list(const tipl::image<3,std::vector<short> >& regi
     });
 }
 
-void TractModel::get_end_list(const tipl::image<3,std::vector<short> >& region_map,
+void TractModel::get_end_list(const region_set_map& region_map,
                               std::vector<std::vector<short> >& end_pair1,
                               std::vector<std::vector<short> >& end_pair2) const
 {
@@ -3241,8 +3744,8 @@ void TractModel::get_end_list(const tipl::image<3,std::vector<short> >& region_m
                                     std::round(tract_data[index][tract_data[index].size()-1]),geo);
         if(!geo.is_valid(end1) || !geo.is_valid(end2))
             return;
-        end_pair1[index] = region_map[end1.index()];
-        end_pair2[index] = region_map[end2.index()];
+        end_pair1[index].assign(region_map.begin(end1.index()),region_map.end(end1.index()));
+        end_pair2[index].assign(region_map.begin(end2.index()),region_map.end(end2.index()));
     });
 }
 
@@ -3358,10 +3861,11 @@ void ConnectivityMatrix::set_regions(const tipl::shape<3>& geo,
                                      const std::vector<std::shared_ptr<ROIRegion> >& regions)
 {
     region_count = regions.size();
-    region_map.clear();
-    region_map.resize(geo);
+    region_map.clear(geo,region_count);
 
-    std::vector<std::set<uint16_t> > regions_set(geo.size());
+    // regions are added in order, so each voxel's region set stays sorted
+    std::map<std::pair<uint32_t,uint32_t>,uint32_t> add_region;
+    std::vector<short> new_set;
     for(size_t roi = 0;roi < regions.size();++roi)
     {
         std::vector<tipl::vector<3,short> > points;
@@ -3369,18 +3873,33 @@ void ConnectivityMatrix::set_regions(const tipl::shape<3>& geo,
         for(size_t index = 0;index < points.size();++index)
         {
             tipl::vector<3,short> pos = points[index];
-            if(geo.is_valid(pos))
-                regions_set[tipl::pixel_index<3>(pos[0],pos[1],pos[2],geo).index()].insert(uint16_t(roi));
+            if(!geo.is_valid(pos))
+                continue;
+            auto& id = region_map.id[tipl::pixel_index<3>(pos[0],pos[1],pos[2],geo).index()];
+            if(!id)
+            {
+                id = uint32_t(roi)+1;
+                continue;
+            }
+            if(region_map.label[region_map.offset[id+1]-1] == short(roi))
+                continue;
+            auto key = std::make_pair(id,uint32_t(roi));
+            auto iter = add_region.find(key);
+            if(iter == add_region.end())
+            {
+                new_set.assign(region_map.label.begin()+region_map.offset[id],region_map.label.begin()+region_map.offset[id+1]);
+                new_set.push_back(short(roi));
+                iter = add_region.insert(std::make_pair(key,region_map.get_set_id(new_set))).first;
+            }
+            id = iter->second;
         }
     }
     unsigned int overlap_count = 0,total_count = 0;
-    for(unsigned int index = 0;index < geo.size();++index)
-        if(!regions_set[index].empty())
+    for(size_t index = 0;index < geo.size();++index)
+        if(region_map.id[index])
         {
-            for(auto i : regions_set[index])
-                region_map[index].push_back(short(i));
             ++total_count;
-            if(region_map[index].size() > 1)
+            if(region_map.is_overlap(index))
                 ++overlap_count;
         }
     overlap_ratio = float(overlap_count)/float(total_count);
@@ -3408,25 +3927,33 @@ bool ConnectivityMatrix::set_atlas(std::shared_ptr<atlas> data,
     }
 
     const auto& s2t = handle->get_sub2temp_mapping();
-    region_map.clear();
-    region_map.resize(handle->dim);
-    tipl::par_for(region_map.size(),[&](size_t index)
+    region_map.clear(handle->dim,region_count);
+    // single-region voxels go directly into the map, overlapping voxels are resolved afterward
+    std::vector<std::vector<std::pair<size_t,std::vector<short> > > > overlap(std::thread::hardware_concurrency());
+    tipl::par_for(region_map.id.size(),[&](size_t index,size_t thread)
     {
+        std::vector<short> regions;
         for(unsigned int i = 0;i < region_count;++i)
         {
             if(data->is_labeled_as(s2t[index],i))
-                region_map[index].push_back(short(i));
+                regions.push_back(short(i));
         }
+        if(regions.size() <= 1)
+            region_map.id[index] = regions.empty() ? 0 : uint32_t(regions[0])+1;
+        else
+            overlap[thread].push_back(std::make_pair(index,std::move(regions)));
     });
 
     unsigned int overlap_count = 0,total_count = 0;
-    for(unsigned int index = 0;index < region_map.size();++index)
-        if(!region_map[index].empty())
+    for(auto& overlap_per_thread : overlap)
+        for(auto& each : overlap_per_thread)
         {
-            ++total_count;
-            if(region_map[index].size() > 1)
-                ++overlap_count;
+            region_map.id[each.first] = region_map.get_set_id(each.second);
+            ++overlap_count;
         }
+    for(size_t index = 0;index < region_map.id.size();++index)
+        if(region_map.id[index])
+            ++total_count;
     overlap_ratio = float(overlap_count)/float(total_count);
     atlas_name = data->name;
     return true;
@@ -3441,35 +3968,55 @@ void init_matrix(m_type& m,unsigned int size)
         m[i].resize(size);
 }
 
+template<class T>
+void get_region_pair(const T& r1,const T& r2,std::vector<std::pair<uint32_t,uint32_t> >& region_pair)
+{
+    region_pair.clear();
+    for(unsigned int i = 0;i < r1.size();++i)
+        for(unsigned int j = 0;j < r2.size();++j)
+            if(r1[i] != r2[j])
+            {
+                region_pair.push_back(std::make_pair(uint32_t(r1[i]),uint32_t(r2[j])));
+                region_pair.push_back(std::make_pair(uint32_t(r2[j]),uint32_t(r1[i])));
+            }
+    // remove duplicates
+    std::sort(region_pair.begin(), region_pair.end());
+    region_pair.erase(std::unique(region_pair.begin(), region_pair.end()), region_pair.end());
+}
+
 template<class T,class fun_type>
 void for_each_connectivity(const T& end_list1,
                            const T& end_list2,
                            fun_type lambda_fun)
 {
-    for(unsigned int index = 0;index < end_list1.size();++index)
-    {
-        const auto& r1 = end_list1[index];
-        const auto& r2 = end_list2[index];
-        std::vector<std::pair<uint32_t,uint32_t> > region_pair;
-        for(unsigned int i = 0;i < r1.size();++i)
-            for(unsigned int j = 0;j < r2.size();++j)
-                if(r1[i] != r2[j])
-                {
-                    region_pair.push_back(std::make_pair(uint32_t(r1[i]),uint32_t(r2[j])));
-                    region_pair.push_back(std::make_pair(uint32_t(r2[j]),uint32_t(r1[i])));
-                }
-        // remove duplicates
-        std::sort(region_pair.begin(), region_pair.end());
-        region_pair.erase(std::unique(region_pair.begin(), region_pair.end()), region_pair.end());
-
-        for(const auto& pair : region_pair)
-            lambda_fun(index,pair.first,pair.second);
+    // region pairs are built in parallel one block at a time
+    // and then visited in tract order so that accumulations stay deterministic
+    const size_t block_size = 65536;
+    std::vector<std::vector<std::pair<uint32_t,uint32_t> > > region_pair(std::min(block_size,end_list1.size()));
+    for(size_t from = 0;from < end_list1.size();from += block_size)
+    {
+        size_t size = std::min(block_size,end_list1.size()-from);
+        tipl::par_for(size,[&](size_t k)
+        {
+            get_region_pair(end_list1[from+k],end_list2[from+k],region_pair[k]);
+        });
+        for(size_t k = 0;k < size;++k)
+            for(const auto& pair : region_pair[k])
+                lambda_fun(uint32_t(from+k),pair.first,pair.second);
     }
 }
 
 bool ConnectivityMatrix::calculate(std::shared_ptr<fib_data> handle,
                                    TractModel& tract_model,std::string matrix_value_type,bool use_end_only,float threshold)
 {
+    if(matrix_value_type != "trk")
+    {
+        std::vector<tipl::image<2> > result;
+        if(!calculate(handle,tract_model,std::vector<std::string>{matrix_value_type},use_end_only,threshold,result))
+            return false;
+        matrix_value.swap(result[0]);
+        return true;
+    }
     if(region_count == 0)
     {
         error_msg = "No region information. Please assign regions";
@@ -3481,134 +4028,159 @@ bool ConnectivityMatrix::calculate(std::shared_ptr<fib_data> handle,
         tract_model.get_end_list(region_map,end_list1,end_list2);
     else
         tract_model.get_passing_list(region_map,uint32_t(region_count),end_list1,end_list2);
-    if(matrix_value_type == "trk")
-    {
-        std::vector<std::vector<std::vector<unsigned int> > > region_passing_list;
-        init_matrix(region_passing_list,uint32_t(region_count));
 
-        for_each_connectivity(end_list1,end_list2,
-                              [&](unsigned int index,unsigned int i,unsigned int j){
-            region_passing_list[i][j].push_back(index);
-        });
+    std::vector<std::vector<std::vector<unsigned int> > > region_passing_list;
+    init_matrix(region_passing_list,uint32_t(region_count));
+
+    for_each_connectivity(end_list1,end_list2,
+                          [&](unsigned int index,unsigned int i,unsigned int j){
+        region_passing_list[i][j].push_back(index);
+    });
+
+    for(unsigned int i = 0;i < region_passing_list.size();++i)
+        for(unsigned int j = i+1;j < region_passing_list.size();++j)
+        {
+            if(region_passing_list[i][j].empty())
+                continue;
+            std::string file_name = region_name[i]+"_"+region_name[j]+".tt.gz";
+            TractModel tm(tract_model.geo,tract_model.vs);
+            tm.report = tract_model.report;
+            tm.trans_to_mni = tract_model.trans_to_mni;
+            std::vector<std::vector<float> > new_tracts;
+            for (unsigned int k = 0;k < region_passing_list[i][j].size();++k)
+                new_tracts.push_back(tract_model.get_tract(region_passing_list[i][j][k]));
+            tm.add_tracts(new_tracts);
+            if(!tm.save_tracts_to_file(file_name.c_str()))
+                return false;
+        }
+    return true;
+}
 
-        for(unsigned int i = 0;i < region_passing_list.size();++i)
-            for(unsigned int j = i+1;j < region_passing_list.size();++j)
+bool ConnectivityMatrix::calculate(std::shared_ptr<fib_data> handle,
+                                   TractModel& tract_model,
+                                   const std::vector<std::string>& matrix_value_types,
+                                   bool use_end_only,float threshold,
+                                   std::vector<tipl::image<2> >& matrix_values)
+{
+    if(region_count == 0)
+    {
+        error_msg = "No region information. Please assign regions";
+        return false;
+    }
+    // resolve all requested metrics first so that an unknown one fails before any tract work
+    bool need_length_list = false;
+    std::vector<unsigned int> index_list;  // index metrics, in request order
+    std::vector<size_t> index_pos(matrix_value_types.size());
+    for(size_t k = 0;k < matrix_value_types.size();++k)
+    {
+        const auto& type = matrix_value_types[k];
+        if(type == "count" || type == "mean_length")
+            continue;
+        if(type == "ncount" || type == "ncount2")
+        {
+            need_length_list = true;
+            continue;
+        }
+        unsigned int index_num = handle->get_name_index(type);
+        if(type == "trk" || index_num == handle->view_item.size())
+        {
+            error_msg = "Cannot quantify matrix value using ";
+            error_msg += type;
+            return false;
+        }
+        index_pos[k] = index_list.size();
+        index_list.push_back(index_num);
+    }
+
+    // the mean of each index along each tract, all metrics sampled in a single sweep
+    std::vector<std::vector<float> > m(index_list.size(),std::vector<float>(tract_model.get_visible_track_count()));
+    if(!index_list.empty())
+        tipl::par_for(tract_model.get_visible_track_count(),[&](unsigned int index)
+        {
+            std::vector<float> data;
+            for(size_t k = 0;k < index_list.size();++k)
             {
-                if(region_passing_list[i][j].empty())
-                    continue;
-                std::string file_name = region_name[i]+"_"+region_name[j]+".tt.gz";
-                TractModel tm(tract_model.geo,tract_model.vs);
-                tm.report = tract_model.report;
-                tm.trans_to_mni = tract_model.trans_to_mni;
-                std::vector<std::vector<float> > new_tracts;
-                for (unsigned int k = 0;k < region_passing_list[i][j].size();++k)
-                    new_tracts.push_back(tract_model.get_tract(region_passing_list[i][j][k]));
-                tm.add_tracts(new_tracts);
-                if(!tm.save_tracts_to_file(file_name.c_str()))
-                    return false;
+                tract_model.get_tract_data(handle,index,index_list[k],data);
+                if(!data.empty())
+                    m[k][index] = float(tipl::mean(data.begin(),data.end()));
             }
-        return true;
-    }
-    matrix_value.clear();
-    matrix_value.resize(tipl::shape<2>(uint32_t(region_count),uint32_t(region_count)));
-    std::vector<std::vector<unsigned int> > count;
-    init_matrix(count,uint32_t(region_count));
+        });
 
+    std::vector<std::vector<short> > end_list1,end_list2;
+    if(use_end_only)
+        tract_model.get_end_list(region_map,end_list1,end_list2);
+    else
+        tract_model.get_passing_list(region_map,uint32_t(region_count),end_list1,end_list2);
+
+    // accumulate every metric from the same region pairs
+    size_t matrix_size = region_count*region_count;
+    std::vector<unsigned int> count(matrix_size),sum_length(matrix_size);
+    std::vector<std::vector<unsigned int> > length_list(need_length_list ? matrix_size : 0);
+    std::vector<std::vector<float> > sum(index_list.size(),std::vector<float>(matrix_size));
     for_each_connectivity(end_list1,end_list2,
-                          [&](unsigned int,unsigned int i,unsigned int j){
-        ++count[i][j];
+                          [&](unsigned int index,unsigned int i,unsigned int j){
+        size_t pos = size_t(i)*region_count+j;
+        auto length = uint32_t(tract_model.get_tract_length(index));
+        ++count[pos];
+        sum_length[pos] += length;
+        if(need_length_list)
+            length_list[pos].push_back(length);
+        for(size_t k = 0;k < sum.size();++k)
+            sum[k][pos] += m[k][index];
     });
 
     // determine the threshold for counting the connectivity
-    unsigned int threshold_count = 0;
-    for(unsigned int i = 0,index = 0;i < count.size();++i)
-        for(unsigned int j = 0;j < count[i].size();++j,++index)
-            threshold_count = std::max<unsigned int>(threshold_count,count[i][j]);
+    unsigned int threshold_count = count.empty() ? 0 : *std::max_element(count.begin(),count.end());
     threshold_count *= threshold;
 
-    if(matrix_value_type == "count")
-    {
-        for(unsigned int i = 0,index = 0;i < count.size();++i)
-            for(unsigned int j = 0;j < count[i].size();++j,++index)
-                matrix_value[index] = (count[i][j] > threshold_count ? count[i][j] : 0);
-        return true;
-    }
-    if(matrix_value_type == "ncount" || matrix_value_type == "ncount2")
+    matrix_values.clear();
+    matrix_values.resize(matrix_value_types.size());
+    for(size_t k = 0;k < matrix_value_types.size();++k)
     {
-        std::vector<std::vector<std::vector<unsigned int> > > length_matrix;
-        init_matrix(length_matrix,uint32_t(region_count));
-
-        for_each_connectivity(end_list1,end_list2,
-                              [&](unsigned int index,unsigned int i,unsigned int j){
-            length_matrix[i][j].push_back(uint32_t(tract_model.get_tract_length(index)));
-        });
-
-        for(unsigned int i = 0,index = 0;i < count.size();++i)
-            for(unsigned int j = 0;j < count[i].size();++j,++index)
-                if(!length_matrix[i][j].empty() && count[i][j] >= threshold_count)
+        const auto& type = matrix_value_types[k];
+        auto& value = matrix_values[k];
+        value.resize(tipl::shape<2>(uint32_t(region_count),uint32_t(region_count)));
+        if(type == "count")
+        {
+            for(size_t index = 0;index < matrix_size;++index)
+                value[index] = (count[index] > threshold_count ? count[index] : 0);
+            continue;
+        }
+        if(type == "ncount" || type == "ncount2")
+        {
+            for(size_t index = 0;index < matrix_size;++index)
+                if(!length_list[index].empty() && count[index] >= threshold_count)
                 {
                     float length = 0.0;
-                    if(matrix_value_type == "ncount")
-                        length = 1.0f/tipl::median(length_matrix[i][j].begin(),length_matrix[i][j].end());
+                    if(type == "ncount")
+                    {
+                        // median reorders its input, keep the list intact for ncount2
+                        auto lengths = length_list[index];
+                        length = 1.0f/tipl::median(lengths.begin(),lengths.end());
+                    }
                     else
                     {
-                        for(unsigned int k = 0;k < length_matrix[i][j].size();++k)
-                            length += 1.0f/length_matrix[i][j][k];
+                        for(unsigned int l = 0;l < length_list[index].size();++l)
+                            length += 1.0f/length_list[index][l];
                     }
-                    matrix_value[index] = count[i][j]*length;
+                    value[index] = count[index]*length;
                 }
-                else
-                    matrix_value[index] = 0;
-
-        return true;
-    }
-
-
-    if(matrix_value_type == "mean_length")
-    {
-        std::vector<std::vector<unsigned int> > sum_length,sum_n;
-        init_matrix(sum_length,uint32_t(region_count));
-        init_matrix(sum_n,uint32_t(region_count));
-
-        for_each_connectivity(end_list1,end_list2,
-                              [&](unsigned int index,unsigned int i,unsigned int j){
-            sum_length[i][j] += tract_model.get_tract_length(index);
-            ++sum_n[i][j];
-        });
-
-        for(unsigned int i = 0,index = 0;i < count.size();++i)
-            for(unsigned int j = 0;j < count[i].size();++j,++index)
-                if(sum_n[i][j] && count[i][j] > threshold_count)
-                    matrix_value[index] = float(sum_length[i][j])/float(sum_n[i][j])/3.0f;
-        return true;
-    }
-    std::vector<std::vector<float> > data;
-    if(!tract_model.get_tracts_data(handle,matrix_value_type,data))
-    {
-        error_msg = "Cannot quantify matrix value using ";
-        error_msg += matrix_value_type;
-        return false;
+            continue;
+        }
+        if(type == "mean_length")
+        {
+            for(size_t index = 0;index < matrix_size;++index)
+                if(count[index] && count[index] > threshold_count)
+                    value[index] = float(sum_length[index])/float(count[index])/3.0f;
+            continue;
+        }
+        const auto& s = sum[index_pos[k]];
+        for(size_t index = 0;index < matrix_size;++index)
+            value[index] = (count[index] > threshold_count ? s[index]/float(count[index]) : 0.0f);
     }
-    std::vector<std::vector<float> > sum;
-    init_matrix(sum,uint32_t(region_count));
-
-    std::vector<float> m(data.size());
-    for(unsigned int index = 0;index < data.size();++index)
-        if(!data[index].empty())
-            m[index] = float(tipl::mean(data[index].begin(),data[index].end()));
-
-    for_each_connectivity(end_list1,end_list2,
-                          [&](unsigned int index,unsigned int i,unsigned int j){
-        sum[i][j] += m[index];
-    });
-
-
-    for(unsigned int i = 0,index = 0;i < count.size();++i)
-        for(unsigned int j = 0;j < count[i].size();++j,++index)
-            matrix_value[index] = (count[i][j] > threshold_count ? sum[i][j]/float(count[i][j]) : 0.0f);
     return true;
-
 }
+
 template<class matrix_type>
 void distance_bin(const matrix_type& bin,tipl::image<2,float>& D)
 {
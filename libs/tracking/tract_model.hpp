@@ -1,12 +1,120 @@
 #ifndef TRACT_MODEL_HPP
 #define TRACT_MODEL_HPP
 #include <vector>
+#include <map>
 #include <iosfwd>
 #include "TIPL/tipl.hpp"
 #include "fib_data.hpp"
 
 class RoiMgr;
 void initial_LPS_nifti_srow(tipl::matrix<4,4>& T,const tipl::shape<3>& geo,const tipl::vector<3>& vs);
+
+class QFile;
+// .ttx tractography file mapped into memory for random access.
+// The file holds a header, the offset of each streamline in the point pool,
+// the point pool, and optional per-streamline cluster labels and colors.
+// get_tract returns views into the mapping; TractModel::load_from_file
+// copies every streamline out, so a loaded model does not stay mapped.
+class mapped_tract_file{
+public:
+    struct header_type{
+        char magic[8] = {'D','S','I','T','T','X','1',0};
+        uint64_t tract_count = 0;
+        uint64_t pool_size = 0;     // number of floats in the point pool
+        uint64_t offset_pos = 0;    // byte positions of the sections, 0 if absent
+        uint64_t pool_pos = 0;
+        uint64_t cluster_pos = 0;
+        uint64_t color_pos = 0;
+        uint64_t text_pos = 0;
+        uint64_t text_size = 0;
+        int32_t dim[3] = {0,0,0};
+        float vs[3] = {0.0f,0.0f,0.0f};
+        float trans_to_mni[16] = {0.0f};
+    };
+private:
+    std::shared_ptr<QFile> file;
+    const uint64_t* offset = nullptr;
+    const float* pool = nullptr;
+public:
+    struct tract_view{
+        const float* ptr;
+        size_t length;
+        const float* begin(void) const{return ptr;}
+        const float* end(void) const{return ptr+length;}
+        size_t size(void) const{return length;}
+        bool empty(void) const{return length == 0;}
+        float operator[](size_t i) const{return ptr[i];}
+    };
+public:
+    header_type header;
+    const uint32_t* cluster = nullptr;
+    const uint32_t* color = nullptr;
+    std::string report,parameter_id;
+public:
+    ~mapped_tract_file(void){close();}
+    bool open(const char* file_name);
+    void close(void);
+    size_t size(void) const{return header.tract_count;}
+    tract_view get_tract(size_t i) const
+    {
+        return tract_view{pool+offset[i],size_t(offset[i+1]-offset[i])};
+    }
+    static bool save_to_file(const char* file_name,
+                             const tipl::shape<3>& geo,const tipl::vector<3>& vs,const tipl::matrix<4,4>& trans_to_mni,
+                             const std::vector<std::vector<float> >& tract_data,
+                             const std::vector<unsigned int>& cluster,
+                             const std::vector<unsigned int>& color,
+                             const std::string& report,const std::string& parameter_id);
+};
+// region labels of each voxel stored as an id into a table of distinct region sets.
+// id 0 is the empty set and ids 1..region_count are the single-region sets
+struct region_set_map{
+public:
+    tipl::image<3,uint32_t> id;
+    std::vector<uint32_t> offset;
+    std::vector<short> label;
+    size_t region_count = 0;
+private:
+    std::map<std::vector<short>,uint32_t> multi_set_id;
+public:
+    void clear(const tipl::shape<3>& geo,size_t region_count_)
+    {
+        region_count = region_count_;
+        id.clear();
+        id.resize(geo);
+        label.resize(region_count);
+        offset.resize(region_count+2);
+        offset[0] = 0;
+        for(size_t i = 0;i < region_count;++i)
+        {
+            label[i] = short(i);
+            offset[i+1] = uint32_t(i);
+        }
+        offset.back() = uint32_t(region_count);
+        multi_set_id.clear();
+    }
+    // regions should be sorted and unique
+    uint32_t get_set_id(const std::vector<short>& regions)
+    {
+        if(regions.empty())
+            return 0;
+        if(regions.size() == 1)
+            return uint32_t(regions[0])+1;
+        auto iter = multi_set_id.find(regions);
+        if(iter != multi_set_id.end())
+            return iter->second;
+        uint32_t new_id = uint32_t(offset.size()-1);
+        label.insert(label.end(),regions.begin(),regions.end());
+        offset.push_back(uint32_t(label.size()));
+        multi_set_id[regions] = new_id;
+        return new_id;
+    }
+    const short* begin(size_t voxel) const{return label.data()+offset[id[voxel]];}
+    const short* end(size_t voxel) const{return label.data()+offset[id[voxel]+1];}
+    size_t size(size_t voxel) const{return offset[id[voxel]+1]-offset[id[voxel]];}
+    bool is_overlap(size_t voxel) const{return id[voxel] > region_count;}
+};
+
 class TractModel{
 public:
         std::string report;
@@ -121,7 +229,7 @@ public:
         void clear_deleted(void);
         void undo(void);
         void redo(void);
-        bool trim(void);
+        bool trim(unsigned int iterations = 1);
         void resample(float new_step);
         void get_tract_points(std::vector<tipl::vector<3,float> >& points);
         void get_in_slice_tracts(unsigned char dim,int pos,
@@ -156,6 +264,14 @@ public:
                           tipl::shape<3>& dim,
                           tipl::vector<3,float> vs,
                           tipl::matrix<4,4> transformation,bool color,bool end_point);
+        // rasterizes tract segments onto the target grid, optionally with trilinear and length weighting,
+        // and writes the map slab by slab to limit the memory usage at super resolution
+        static bool export_segment_tdi(const char* file_name,
+                          const std::vector<std::shared_ptr<TractModel> >& tract_models,
+                          const tipl::shape<3>& dim,
+                          const tipl::vector<3,float>& vs,
+                          const tipl::matrix<4,4>& transformation,
+                          bool trilinear,bool length_weighted,size_t slab_voxel_count = 64*1024*1024);
         static bool export_pdi(const char* file_name,
                                const std::vector<std::shared_ptr<TractModel> >& tract_models);
         static bool export_end_pdi(const char* file_name,
@@ -180,11 +296,11 @@ public:
         void get_tracts_data(std::shared_ptr<fib_data> handle,unsigned int index_num,float& mean) const;
 public:
 
-        void get_passing_list(const tipl::image<3,std::vector<short> >& region_map,
+        void get_passing_list(const region_set_map& region_map,
                               unsigned int region_count,
                                      std::vector<std::vector<short> >& passing_list1,
                                      std::vector<std::vector<short> >& passing_list2) const;
-        void get_end_list(const tipl::image<3,std::vector<short> >& region_map,
+        void get_end_list(const region_set_map& region_map,
                                      std::vector<std::vector<short> >& end_list1,
                                      std::vector<std::vector<short> >& end_list2) const;
         void run_clustering(unsigned char method_id,unsigned int cluster_count,float param);
@@ -201,7 +317,7 @@ public:
 
     tipl::image<2> matrix_value;
 public:
-    tipl::image<3,std::vector<short> > region_map;
+    region_set_map region_map;
     size_t region_count = 0;
     std::vector<std::string> region_name;
     std::string error_msg,atlas_name;
@@ -215,6 +331,10 @@ public:
     void save_to_connectogram(const char* file_name);
     void save_to_text(std::string& text);
     bool calculate(std::shared_ptr<fib_data> handle,TractModel& tract_model,std::string matrix_value_type,bool use_end_only,float threshold);
+    // computes several matrix values (count, ncount, ncount2, mean_length, or index names) from one pass over the tracts
+    bool calculate(std::shared_ptr<fib_data> handle,TractModel& tract_model,
+                   const std::vector<std::string>& matrix_value_types,bool use_end_only,float threshold,
+                   std::vector<tipl::image<2> >& matrix_values);
     void network_property(std::string& report);
 };
 
@@ -763,7 +763,7 @@ void reconstruction_window::on_actionReplace_b0_by_T2W_image_triggered()
 
     progress prog_("rotating");
     handle->rotate(ref.shape(),vs,manual->get_iT());
-    auto I = tipl::make_image((unsigned short*)handle->src_dwi_data[0],handle->voxel.dim);
+    auto I = handle->dwi_write_at(0);
     ref *= float(tipl::max_value(I))/float(tipl::max_value(ref));
     std::copy(ref.begin(),ref.end(),I.begin());
     update_dimension();
@@ -927,7 +927,8 @@ void reconstruction_window::on_actionSave_SRC_file_as_triggered()
 
 void reconstruction_window::on_actionEddy_Motion_Correction_triggered()
 {
-    handle->correct_motion(false);
+    handle->voxel.thread_count = ui->ThreadCount->value();
+    handle->correct_motion(false,ui->actionParallel_Motion_Correction->isChecked());
     if(!progress::aborted())
     {
         handle->calculate_dwi_sum(true);
@@ -266,8 +266,7 @@ void TractTableWidget::fetch_tracts(void)
                 QString::number(thread_data[index]->get_total_seed_count()));
             if(thread_data[index]->is_ended())
             {
-                has_tracts = thread_data[index]->fetchTracks(tract_models[index].get()) ||
-                             thread_data[index]->fetchTracks(tract_models[index].get()); // clear both front and back buffer
+                has_tracts = thread_data[index]->fetchTracks(tract_models[index].get()) || has_tracts;
                 thread_data[index]->apply_tip(tract_models[index].get());
                 item(int(index),1)->setText(QString::number(tract_models[index]->get_visible_track_count()));
                 item(int(index),2)->setText(QString::number(tract_models[index]->get_deleted_track_count()));
@@ -331,7 +330,7 @@ void TractTableWidget::load_tracts(void)
 {
     load_tracts(QFileDialog::getOpenFileNames(
             this,"Load tracts as",QFileInfo(cur_tracking_window.windowTitle()).absolutePath(),
-            "Tract files (*tt.gz *.trk *trk.gz *.tck);;Text files (*.txt);;All files (*)"));
+            "Tract files (*tt.gz *.trk *trk.gz *.tck *.ttx);;Text files (*.txt);;All files (*)"));
     show_report();
 }
 void TractTableWidget::load_tract_label(void)
@@ -540,7 +539,7 @@ void TractTableWidget::save_tracts_as(void)
     QString filename;
     filename = QFileDialog::getSaveFileName(
                 this,"Save tracts as",item(currentRow(),0)->text().replace(':','_') + output_format(),
-                 "Tract files (*.tt.gz *tt.gz *trk.gz *.trk);;Text File (*.txt);;MAT files (*.mat);;TCK file (*.tck);;ROI files (*.nii *nii.gz);;All files (*)");
+                 "Tract files (*.tt.gz *tt.gz *trk.gz *.trk);;Text File (*.txt);;MAT files (*.mat);;TCK file (*.tck);;Mapped tract file (*.ttx);;ROI files (*.nii *nii.gz);;All files (*)");
     if(filename.isEmpty())
         return;
     std::string sfilename = filename.toLocal8Bit().begin();